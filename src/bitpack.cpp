@@ -0,0 +1,258 @@
+#include "bitpack.h"
+
+#include "predict.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define BITPACK_SSE2
+#endif
+
+namespace bitpack {
+namespace {
+
+// A block is 16 vectors of 8 lanes.
+const size_t LANES = 8;
+const size_t VECTORS_PER_BLOCK = BLOCK_SIZE / LANES;
+
+using predict::unzigzag;
+using predict::zigzag;
+
+// output[i] = zigzag(input[i] - input[i - 1]) with input[-1] = 0. The
+// arithmetic wraps around, so it works for signed and unsigned samples.
+void delta_encode(const uint16_t *input, size_t n, uint16_t *output) {
+    size_t i = 0;
+#ifdef BITPACK_SSE2
+    __m128i prev = _mm_setzero_si128();
+    for (; i + LANES <= n; i += LANES) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+        // input[i - 1], ..., input[i + 6]
+        __m128i shifted =
+            _mm_or_si128(_mm_slli_si128(v, 2), _mm_srli_si128(prev, 14));
+        __m128i d = _mm_sub_epi16(v, shifted);
+        __m128i z = _mm_xor_si128(_mm_slli_epi16(d, 1), _mm_srai_epi16(d, 15));
+        _mm_storeu_si128((__m128i *)(output + i), z);
+        prev = v;
+    }
+#endif
+    uint16_t last = i > 0 ? input[i - 1] : 0;
+    for (; i < n; i++) {
+        output[i] = zigzag((uint16_t)(input[i] - last));
+        last = input[i];
+    }
+}
+
+// The inverse of delta_encode, in place.
+void delta_decode(uint16_t *data, size_t n) {
+    size_t i = 0;
+#ifdef BITPACK_SSE2
+    const __m128i one = _mm_set1_epi16(1);
+    // The last decoded sample in every lane.
+    __m128i carry = _mm_setzero_si128();
+    for (; i + LANES <= n; i += LANES) {
+        __m128i z = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i d =
+            _mm_xor_si128(_mm_srli_epi16(z, 1),
+                          _mm_sub_epi16(_mm_setzero_si128(),
+                                        _mm_and_si128(z, one)));
+        // Prefix sum within the vector in three steps.
+        d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+        d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+        d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+        d = _mm_add_epi16(d, carry);
+        _mm_storeu_si128((__m128i *)(data + i), d);
+        __m128i hi = _mm_shufflehi_epi16(d, 0xff);
+        carry = _mm_unpackhi_epi64(hi, hi);
+    }
+#endif
+    uint16_t last = i > 0 ? data[i - 1] : 0;
+    for (; i < n; i++) {
+        last = (uint16_t)(last + unzigzag(data[i]));
+        data[i] = last;
+    }
+}
+
+int block_width(const uint16_t *block) {
+    uint16_t bits = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        bits |= block[i];
+    }
+    int width = 0;
+    while (bits) {
+        width++;
+        bits >>= 1;
+    }
+    return width;
+}
+
+// Packs a block of values narrower than `width` bits into 16 * width bytes.
+void pack_block(const uint16_t *in, int width, uint8_t *out) {
+    if (width == 0) {
+        return;
+    }
+#ifdef BITPACK_SSE2
+    __m128i *o = (__m128i *)out;
+    __m128i acc = _mm_setzero_si128();
+    int shift = 0;
+    for (size_t i = 0; i < VECTORS_PER_BLOCK; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + LANES * i));
+        acc = _mm_or_si128(acc, _mm_sll_epi16(v, _mm_cvtsi32_si128(shift)));
+        shift += width;
+        if (shift >= 16) {
+            _mm_storeu_si128(o++, acc);
+            shift -= 16;
+            // The bits of v which did not fit.
+            acc = shift > 0 ? _mm_srl_epi16(v, _mm_cvtsi32_si128(width - shift))
+                            : _mm_setzero_si128();
+        }
+    }
+#else
+    for (size_t lane = 0; lane < LANES; lane++) {
+        size_t word = 0;
+        uint16_t acc = 0;
+        int shift = 0;
+        for (size_t i = 0; i < VECTORS_PER_BLOCK; i++) {
+            uint16_t v = in[LANES * i + lane];
+            acc |= (uint16_t)(v << shift);
+            shift += width;
+            if (shift >= 16) {
+                memcpy(out + 2 * (LANES * word + lane), &acc, sizeof(acc));
+                word++;
+                shift -= 16;
+                acc = shift > 0 ? (uint16_t)(v >> (width - shift)) : 0;
+            }
+        }
+    }
+#endif
+}
+
+// The inverse of pack_block.
+void unpack_block(const uint8_t *in, int width, uint16_t *out) {
+    if (width == 0) {
+        memset(out, 0, sizeof(uint16_t) * BLOCK_SIZE);
+        return;
+    }
+#ifdef BITPACK_SSE2
+    const __m128i mask = _mm_set1_epi16((short)((1 << width) - 1));
+    const __m128i *p = (const __m128i *)in;
+    __m128i cur = _mm_loadu_si128(p++);
+    int shift = 0;
+    for (size_t i = 0; i < VECTORS_PER_BLOCK; i++) {
+        __m128i v = _mm_srl_epi16(cur, _mm_cvtsi32_si128(shift));
+        shift += width;
+        if (shift > 16) {
+            // The value continues in the next word.
+            cur = _mm_loadu_si128(p++);
+            shift -= 16;
+            v = _mm_or_si128(
+                v, _mm_sll_epi16(cur, _mm_cvtsi32_si128(width - shift)));
+        } else if (shift == 16 && i + 1 < VECTORS_PER_BLOCK) {
+            cur = _mm_loadu_si128(p++);
+            shift = 0;
+        }
+        _mm_storeu_si128((__m128i *)(out + LANES * i), _mm_and_si128(v, mask));
+    }
+#else
+    const uint16_t mask = (uint16_t)((1 << width) - 1);
+    for (size_t lane = 0; lane < LANES; lane++) {
+        size_t word = 0;
+        uint16_t cur;
+        memcpy(&cur, in + 2 * lane, sizeof(cur));
+        int shift = 0;
+        for (size_t i = 0; i < VECTORS_PER_BLOCK; i++) {
+            uint16_t v = (uint16_t)(cur >> shift);
+            shift += width;
+            if (shift > 16) {
+                word++;
+                memcpy(&cur, in + 2 * (LANES * word + lane), sizeof(cur));
+                shift -= 16;
+                v |= (uint16_t)(cur << (width - shift));
+            } else if (shift == 16 && i + 1 < VECTORS_PER_BLOCK) {
+                word++;
+                memcpy(&cur, in + 2 * (LANES * word + lane), sizeof(cur));
+                shift = 0;
+            }
+            out[LANES * i + lane] = v & mask;
+        }
+    }
+#endif
+}
+
+size_t n_blocks_of(size_t n_samples) {
+    return (n_samples + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+} // namespace
+
+size_t encode_bound(size_t n_samples) {
+    const size_t n_blocks = n_blocks_of(n_samples);
+    return sizeof(uint32_t) + n_blocks + n_blocks * BLOCK_SIZE * 2;
+}
+
+size_t encode(const uint16_t *input, size_t n_samples, uint8_t *output) {
+    const size_t n_blocks = n_blocks_of(n_samples);
+
+    // The last block is padded with zeros.
+    thread_local std::vector<uint16_t> deltas;
+    deltas.resize(n_blocks * BLOCK_SIZE);
+    std::fill(deltas.begin() + n_samples, deltas.end(), 0);
+    delta_encode(input, n_samples, deltas.data());
+
+    uint32_t n = n_samples;
+    memcpy(output, &n, sizeof(n));
+    uint8_t *widths = output + sizeof(n);
+    uint8_t *p = widths + n_blocks;
+    for (size_t k = 0; k < n_blocks; k++) {
+        const uint16_t *block = deltas.data() + k * BLOCK_SIZE;
+        const int width = block_width(block);
+        widths[k] = width;
+        pack_block(block, width, p);
+        p += 2 * LANES * width;
+    }
+    return p - output;
+}
+
+bool decode(const uint8_t *input, size_t input_length, uint16_t *output,
+            size_t n_samples) {
+    uint32_t n;
+    if (input_length < sizeof(n)) {
+        return false;
+    }
+    memcpy(&n, input, sizeof(n));
+    const size_t n_blocks = n_blocks_of(n_samples);
+    if (n != n_samples || input_length < sizeof(n) + n_blocks) {
+        return false;
+    }
+
+    const uint8_t *widths = input + sizeof(n);
+    const uint8_t *p = widths + n_blocks;
+    const uint8_t *end = input + input_length;
+    uint16_t tail[BLOCK_SIZE];
+    for (size_t k = 0; k < n_blocks; k++) {
+        const int width = widths[k];
+        if (width > 16 || end - p < (ptrdiff_t)(2 * LANES * width)) {
+            return false;
+        }
+        const size_t first = k * BLOCK_SIZE;
+        if (first + BLOCK_SIZE <= n_samples) {
+            unpack_block(p, width, output + first);
+        } else {
+            unpack_block(p, width, tail);
+            memcpy(output + first, tail,
+                   sizeof(uint16_t) * (n_samples - first));
+        }
+        p += 2 * LANES * width;
+    }
+    if (p != end) {
+        return false;
+    }
+
+    delta_decode(output, n_samples);
+    return true;
+}
+
+} // namespace bitpack
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Integer compression for 16-bit samples such as quantized channels and depth
+// images. Each sample is replaced with the zigzag-encoded difference from the
+// previous one, and every block of 128 differences is bit-packed with the
+// width of its largest value. Packing is vertical, like SIMD-BP128 with 16-bit
+// lanes: value i of a block goes to lane i % 8 of vector i / 8, so a whole
+// block is packed and unpacked with 128-bit shifts and ORs.
+//
+//   uint32_t n_samples
+//   uint8_t  bit width of each block
+//   packed blocks, 16 * width bytes each
+namespace bitpack {
+
+const size_t BLOCK_SIZE = 128;
+
+// The largest encoded length of n_samples samples.
+size_t encode_bound(size_t n_samples);
+
+// Returns the encoded length.
+size_t encode(const uint16_t *input, size_t n_samples, uint8_t *output);
+
+// Returns false when input is not an encoding of exactly n_samples samples.
+bool decode(const uint8_t *input, size_t input_length, uint16_t *output,
+            size_t n_samples);
+
+} // namespace bitpack
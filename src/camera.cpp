@@ -1,4 +1,6 @@
 #include "camera.h"
+#include "frame_pool.h"
+#include "recording.h"
 
 #include <librealsense2/rs.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -6,7 +8,7 @@
 #include <opencv2/objdetect/objdetect.hpp>
 
 #include <algorithm>
-#include <fstream>
+#include <cmath>
 #include <iostream>
 
 /* Attempt at supporting openCV version 4.0.1 or higher */
@@ -19,111 +21,81 @@
 
 namespace camera {
 
-size_t length_of_serialize_data(camera::rs2_frame_data frame) {
-    // the first 4 bytes of serialized data is the length.
-    return sizeof(uint32_t) * 4 +
-           frame.height * frame.width * 3 * sizeof(uint8_t) +
-           frame.n_points * sizeof(rs2::vertex) +
-           frame.n_points * sizeof(rs2::texture_coordinate);
-}
-
-void save_frame(rs2_frame_data frame, const std::string &path) {
-    size_t len = length_of_serialize_data(frame);
-    char *buf = (char *)malloc(len);
-    char *p = buf;
-
-    *((uint32_t *)p) = (uint32_t)len;
-    p += sizeof(uint32_t);
-
-    *((uint32_t *)p) = frame.height;
-    p += sizeof(uint32_t);
-
-    *((uint32_t *)p) = frame.width;
-    p += sizeof(uint32_t);
-
-    *((uint32_t *)p) = frame.n_points;
-    p += sizeof(uint32_t);
-
-    memcpy(p, frame.rgb.get(),
-           frame.height * frame.width * 3 * sizeof(uint8_t));
-    p += frame.height * frame.width * 3 * sizeof(uint8_t);
-
-    memcpy(p, frame.vertices.get(), frame.n_points * sizeof(rs2::vertex));
-    p += frame.n_points * sizeof(rs2::vertex);
-
-    memcpy(p, frame.texture_coordinates.get(),
-           frame.n_points * sizeof(rs2::texture_coordinate));
-
-    std::ofstream f(path, std::ios::out | std::ios::binary);
-    f.write(buf, len);
-    f.close();
-    free(buf);
-}
-
-rs2_frame_data read_frame(const std::string &path) {
-    char lenbuf[4];
-    char *buf = (char *)malloc(FRAME_DUMP_MAX);
-
-    std::ifstream f(path, std::ios::in | std::ios::binary);
-    f.read(lenbuf, 4);
-
-    size_t len = *((uint32_t *)lenbuf);
-    f.seekg(0, std::ios::beg);
-    f.read(buf, len);
-
-    rs2_frame_data frame;
-    char *p = buf;
-
-    // Skip the first 4 bytes of the length of the serialized data.
-    p += sizeof(uint32_t);
-
-    frame.height = *((uint32_t *)p);
-    p += sizeof(uint32_t);
-
-    frame.width = *((uint32_t *)p);
-    p += sizeof(uint32_t);
-
-    frame.n_points = *((uint32_t *)p);
-    p += sizeof(uint32_t);
-
-    LOG(INFO) << "frame.height = " << frame.height
-              << ", frame.width = " << frame.width
-              << ", frame.n_points = " << frame.n_points;
-
-    std::shared_ptr<uint8_t> rgb_tmp(
-        new uint8_t[3 * frame.width * frame.height],
-        std::default_delete<uint8_t[]>());
-    frame.rgb = rgb_tmp;
-    memcpy(frame.rgb.get(), p,
-           sizeof(uint8_t) * 3 * frame.width * frame.height);
-    p += sizeof(uint8_t) * 3 * frame.width * frame.height;
-
-    std::shared_ptr<rs2::vertex> vertices_tmp(
-        new rs2::vertex[frame.n_points], std::default_delete<rs2::vertex[]>());
-    frame.vertices = vertices_tmp;
-    memcpy(frame.vertices.get(), p, sizeof(rs2::vertex) * frame.n_points);
-    p += sizeof(rs2::vertex) * frame.n_points;
-
-    std::shared_ptr<rs2::texture_coordinate> texture_coordinates_tmp(
-        new rs2::texture_coordinate[frame.n_points],
-        std::default_delete<rs2::texture_coordinate[]>());
-    frame.texture_coordinates = texture_coordinates_tmp;
-    memcpy(frame.texture_coordinates.get(), p,
-           sizeof(rs2::texture_coordinate) * frame.n_points);
+void segment_depth(const SegmentationOptions &options, float depth_scale,
+                   int width, int height, uint16_t *depth) {
+    const int n = width * height;
+    if (options.near_clip > 0.0f || options.far_clip > 0.0f) {
+        const int near = (int)std::ceil(options.near_clip / depth_scale);
+        const int far = options.far_clip > 0.0f
+                            ? (int)(options.far_clip / depth_scale)
+                            : 0xffff;
+        for (int i = 0; i < n; i++) {
+            if (depth[i] < near || depth[i] > far) {
+                depth[i] = 0;
+            }
+        }
+    }
+    if (!options.largest_component) {
+        return;
+    }
 
-    return frame;
+    // Kept between frames, so that connectedComponentsWithStats reuses them.
+    thread_local cv::Mat mask, labels, stats, centroids;
+    mask.create(height, width, CV_8UC1);
+    for (int i = 0; i < n; i++) {
+        mask.data[i] = depth[i] != 0;
+    }
+    const int n_labels = cv::connectedComponentsWithStats(
+        mask, labels, stats, centroids, 8, CV_32S);
+    // Label 0 is the removed samples.
+    int largest = 0, largest_area = 0;
+    for (int label = 1; label < n_labels; label++) {
+        const int area = stats.at<int>(label, cv::CC_STAT_AREA);
+        if (area > largest_area) {
+            largest = label;
+            largest_area = area;
+        }
+    }
+    const int32_t *label_of = (const int32_t *)labels.data;
+    for (int i = 0; i < n; i++) {
+        if (label_of[i] != largest) {
+            depth[i] = 0;
+        }
+    }
 }
 
 int camera_main_loop(
     ThreadSafeState<eye_like::EyesPosition>::ThreadSafeStatePutViewer
         &eye_pos_put,
     ThreadSafeQueue<rs2_frame_data>::ThreadSafeQueuePushViewer &frame_queue,
-    bool use_realsense, bool debug = false) try {
+    bool use_realsense, bool debug, SegmentationOptions segmentation,
+    RecordingOptions recording) try {
 
     LOG(INFO) << "camera_main_loop start";
 
+    if (!recording.replay_path.empty()) {
+        RecordingPlayer player(Recording::open(recording.replay_path),
+                               recording.max_speed, recording.loop);
+        rs2_frame_data f;
+        eye_like::EyesPosition eyes_position;
+        while (player.next(f, eyes_position)) {
+            eye_pos_put.put(eyes_position);
+            frame_queue.push(f);
+        }
+        LOG(INFO) << "Played " << recording.replay_path;
+        return EXIT_SUCCESS;
+    }
+
     eye_like::init();
     if (use_realsense) {
+        if (debug && recording.record_path.empty()) {
+            recording.record_path = realsense_recording_file;
+        }
+        std::unique_ptr<RecordingWriter> recorder;
+        if (!recording.record_path.empty()) {
+            recorder = std::make_unique<RecordingWriter>(recording.record_path);
+        }
+
         // Declare RealSense pipeline, encapsulating the actual device and
         // sensors
         rs2::pipeline pipe;
@@ -145,8 +117,21 @@ int camera_main_loop(
             sensor.set_option(RS2_OPTION_FRAMES_QUEUE_SIZE, 0);
         }
 
+        // These do not change while the pipeline is running.
+        const float depth_scale =
+            profile.get_device().first<rs2::depth_sensor>().get_depth_scale();
+        const auto depth_profile = profile.get_stream(RS2_STREAM_DEPTH)
+                                       .as<rs2::video_stream_profile>();
+        const auto color_profile = profile.get_stream(RS2_STREAM_COLOR)
+                                       .as<rs2::video_stream_profile>();
+        const rs2_intrinsics depth_intrinsics = depth_profile.get_intrinsics();
+        const rs2_intrinsics color_intrinsics = color_profile.get_intrinsics();
+        const rs2_extrinsics depth_to_color =
+            depth_profile.get_extrinsics_to(color_profile);
+
         rs2::pointcloud pc;
         rs2::points points;
+        FramePool frame_pool(FRAME_POOL_CAPACITY);
 
         while (1) {
             // Wait for the next set of frames from the camera
@@ -172,34 +157,48 @@ int camera_main_loop(
                 rs2_frame_data f;
                 f.height = color.get_height();
                 f.width = color.get_width();
-                std::shared_ptr<uint8_t> rgb_tmp(
-                    new uint8_t[3 * f.width * f.height],
-                    std::default_delete<uint8_t[]>());
-                f.rgb = rgb_tmp;
-                memcpy(f.rgb.get(), color.get_data(),
-                       sizeof(uint8_t) * 3 * f.width * f.height);
-
                 pc.map_to(color);
                 points = pc.calculate(depth);
                 f.n_points = points.size();
-                std::shared_ptr<rs2::vertex> vertices_tmp(
-                    new rs2::vertex[f.n_points],
-                    std::default_delete<rs2::vertex[]>());
-                f.vertices = vertices_tmp;
+                if (!frame_pool.acquire(f, f.width, f.height, f.n_points,
+                                        true)) {
+                    // The later stages are behind, so the frame would only
+                    // wait in the queue.
+                    LOG(WARNING) << "Dropped a camera frame: all "
+                                 << FRAME_POOL_CAPACITY
+                                 << " frame buffers are in use";
+                    continue;
+                }
+                memcpy(f.rgb.get(), color.get_data(),
+                       sizeof(uint8_t) * 3 * f.width * f.height);
+                memcpy(f.depth.get(), depth.get_data(),
+                       sizeof(uint16_t) * f.n_points);
                 memcpy(f.vertices.get(), points.get_vertices(),
                        sizeof(rs2::vertex) * f.n_points);
-                std::shared_ptr<rs2::texture_coordinate>
-                    texture_coordinates_tmp(
-                        new rs2::texture_coordinate[f.n_points],
-                        std::default_delete<rs2::texture_coordinate[]>());
-                f.texture_coordinates = texture_coordinates_tmp;
+                if (segmentation.enabled()) {
+                    segment_depth(segmentation, depth_scale,
+                                  depth.get_width(), depth.get_height(),
+                                  f.depth.get());
+                    const uint16_t *d = f.depth.get();
+                    rs2::vertex *v = f.vertices.get();
+                    for (uint32_t i = 0; i < f.n_points; i++) {
+                        if (d[i] == 0) {
+                            v[i] = {0.0f, 0.0f, 0.0f};
+                        }
+                    }
+                }
                 memcpy(f.texture_coordinates.get(),
                        points.get_texture_coordinates(),
                        sizeof(rs2::texture_coordinate) * f.n_points);
 
-                if (debug) {
-                    save_frame(f, realsense_frame_dump_file);
-                    read_frame(realsense_frame_dump_file);
+                f.depth_intrinsics = depth_intrinsics;
+                f.depth_scale = depth_scale;
+                f.color_intrinsics = color_intrinsics;
+                f.depth_to_color = depth_to_color;
+                f.face = eye_like::face_rect;
+
+                if (recorder) {
+                    recorder->append(f, eyes_position);
                 }
 
                 frame_queue.push(f);
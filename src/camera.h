@@ -14,25 +14,68 @@ namespace camera {
 const int FPS = 15;
 const int FRAME_WIDTH = 640;
 const int FRAME_HEIGHT = 360;
-const int FRAME_DUMP_MAX =
-    sizeof(uint32_t) * 4 + FRAME_HEIGHT * FRAME_WIDTH * 3 * sizeof(uint8_t) +
-    FRAME_HEIGHT * FRAME_WIDTH * sizeof(rs2::vertex) +
-    FRAME_HEIGHT * FRAME_WIDTH * sizeof(rs2::texture_coordinate);
-const std::string realsense_frame_dump_file = "../misc/realsense_frame_dump";
+// Camera frames in flight between the camera and the connector. When all of
+// them are in use, the camera drops frames.
+const int FRAME_POOL_CAPACITY = 4;
+// Written by the camera and played by the renderer in debug mode.
+const std::string realsense_recording_file = "../misc/realsense_recording";
 
 struct rs2_frame_data {
     uint32_t height, width, n_points;
     std::shared_ptr<uint8_t> rgb;
     std::shared_ptr<rs2::vertex> vertices;
     std::shared_ptr<rs2::texture_coordinate> texture_coordinates;
+    // The native Z16 depth image and the calibration of the camera. depth is
+    // empty and the calibration is not set when the frame does not come from
+    // a RealSense camera.
+    std::shared_ptr<uint16_t> depth;
+    rs2_intrinsics depth_intrinsics;
+    float depth_scale;
+    rs2_intrinsics color_intrinsics;
+    rs2_extrinsics depth_to_color;
+    // The face in the color image. Empty when none was found.
+    cv::Rect face;
+    // The peer the frame came from in a call with several. 0 otherwise.
+    uint32_t source = 0;
 };
 
-void save_frame(rs2_frame_data frame, const std::string &path);
+// Keeps the foreground of the depth image only. Removed samples get depth 0,
+// which every later stage treats as no point, so they are not encoded, sent
+// or drawn.
+struct SegmentationOptions {
+    // In metres. 0 disables the clip.
+    float near_clip = 0.0f;
+    float far_clip = 0.0f;
+    // Keep the largest 8-connected region of the samples left by the clip.
+    bool largest_component = false;
 
-rs2_frame_data read_frame(const std::string &path);
+    bool enabled() const {
+        return near_clip > 0.0f || far_clip > 0.0f || largest_component;
+    }
+};
+
+void segment_depth(const SegmentationOptions &options, float depth_scale,
+                   int width, int height, uint16_t *depth);
+
+// See recording.h.
+struct RecordingOptions {
+    // Append every camera frame to this file.
+    std::string record_path;
+    // Play this file instead of opening a camera.
+    std::string replay_path;
+    // Play as fast as the later stages take the frames instead of at the
+    // recorded rate.
+    bool max_speed = false;
+    // Start over after the last frame.
+    bool loop = true;
+};
 
+// In debug mode, the RealSense frames are recorded to
+// realsense_recording_file unless recording.record_path is set.
 int camera_main_loop(
     ThreadSafeState<eye_like::EyesPosition>::ThreadSafeStatePutViewer &eye_pos,
     ThreadSafeQueue<rs2_frame_data>::ThreadSafeQueuePushViewer &frame_queue,
-    bool use_realsense, bool debug);
+    bool use_realsense, bool debug,
+    SegmentationOptions segmentation = SegmentationOptions(),
+    RecordingOptions recording = RecordingOptions());
 } // namespace camera
@@ -1,9 +1,21 @@
+#include "compress.h"
+
+#include "bitpack.h"
+
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <zlib.h>
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include <iostream>
+#include <stdexcept>
 
 #if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
 #include <fcntl.h>
@@ -13,8 +25,9 @@
 #define SET_BINARY_MODE(file)
 #endif
 
-// You must allocate enough memory to *output.
-int compress(char *input, int input_length, char *output, int *output_length) {
+// compressBound(input_length) bytes of output are always enough.
+int compress(const char *input, int input_length, char *output,
+             int *output_length, int level) {
     int ret;
     z_stream strm;
 
@@ -22,26 +35,26 @@ int compress(char *input, int input_length, char *output, int *output_length) {
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, Z_BEST_COMPRESSION);
+    ret = deflateInit(&strm, level);
     if (ret != Z_OK)
         return ret;
 
     strm.avail_in = input_length;
     strm.next_in = (Bytef *)input;
-    strm.avail_out = input_length;
+    strm.avail_out = *output_length;
     strm.next_out = (Bytef *)output;
     ret = deflate(&strm, Z_FINISH); /* no bad return value */
     assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-    assert(ret == Z_STREAM_END);    /* stream will be complete */
-    *output_length = input_length - strm.avail_out;
+    *output_length = *output_length - strm.avail_out;
 
     /* clean up and return */
     (void)deflateEnd(&strm);
-    return Z_OK;
+    /* the output was too small if the stream is not complete */
+    return ret == Z_STREAM_END ? Z_OK : Z_BUF_ERROR;
 }
 
 // You must allocate enough memory to *output.
-int decompress(char *input, int input_length, char *output,
+int decompress(const char *input, int input_length, char *output,
                int *output_length) {
     int ret;
     z_stream strm;
@@ -79,6 +92,136 @@ int decompress(char *input, int input_length, char *output,
     return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
 }
 
+namespace {
+
+class RvlWriter {
+  public:
+    explicit RvlWriter(char *output_) : output(output_), p(output_) {}
+
+    void put(uint32_t value) {
+        do {
+            uint32_t nibble = value & 0x7;
+            value >>= 3;
+            if (value)
+                nibble |= 0x8;
+            word = (word << 4) | nibble;
+            if (++n_nibbles == 8) {
+                flush();
+            }
+        } while (value);
+    }
+
+    // Returns the length of the output.
+    int finish() {
+        if (n_nibbles > 0) {
+            word <<= 4 * (8 - n_nibbles);
+            flush();
+        }
+        return p - output;
+    }
+
+  private:
+    void flush() {
+        memcpy(p, &word, sizeof(word));
+        p += sizeof(word);
+        word = 0;
+        n_nibbles = 0;
+    }
+
+    char *output;
+    char *p;
+    uint32_t word = 0;
+    int n_nibbles = 0;
+};
+
+class RvlReader {
+  public:
+    RvlReader(const char *input, int input_length)
+        : p(input), end(input + input_length) {}
+
+    bool get(uint32_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 32; shift += 3) {
+            if (n_nibbles == 0) {
+                if (end - p < (ptrdiff_t)sizeof(word))
+                    return false;
+                memcpy(&word, p, sizeof(word));
+                p += sizeof(word);
+                n_nibbles = 8;
+            }
+            const uint32_t nibble = word >> 28;
+            word <<= 4;
+            n_nibbles--;
+            value |= (nibble & 0x7) << shift;
+            if (!(nibble & 0x8))
+                return true;
+        }
+        return false;
+    }
+
+  private:
+    const char *p;
+    const char *end;
+    uint32_t word = 0;
+    int n_nibbles = 0;
+};
+
+} // namespace
+
+int rvl_bound(int n_pixels) {
+    // A pixel takes at most 6 nibbles for its delta and 2 for the runs around
+    // it.
+    return (n_pixels + 2) * 4 + 2 * sizeof(uint32_t);
+}
+
+int compress_rvl(const uint16_t *input, int n_pixels, char *output) {
+    RvlWriter writer(output);
+    const uint16_t *end = input + n_pixels;
+    int previous = 0;
+    while (input != end) {
+        int zeros = 0;
+        for (; input != end && !*input; input++)
+            zeros++;
+        writer.put(zeros);
+        int nonzeros = 0;
+        for (const uint16_t *p = input; p != end && *p; p++)
+            nonzeros++;
+        writer.put(nonzeros);
+        for (int i = 0; i < nonzeros; i++) {
+            const int current = *input++;
+            const int delta = current - previous;
+            writer.put((uint32_t)((delta << 1) ^ (delta >> 31)));
+            previous = current;
+        }
+    }
+    return writer.finish();
+}
+
+bool decompress_rvl(const char *input, int input_length, uint16_t *output,
+                    int n_pixels) {
+    RvlReader reader(input, input_length);
+    uint16_t *end = output + n_pixels;
+    int previous = 0;
+    while (output != end) {
+        uint32_t zeros, nonzeros;
+        if (!reader.get(zeros) || zeros > (uint32_t)(end - output))
+            return false;
+        memset(output, 0, zeros * sizeof(uint16_t));
+        output += zeros;
+        if (!reader.get(nonzeros) || nonzeros > (uint32_t)(end - output))
+            return false;
+        for (uint32_t i = 0; i < nonzeros; i++) {
+            uint32_t positive;
+            if (!reader.get(positive))
+                return false;
+            const int delta = (int)(positive >> 1) ^ -(int)(positive & 1);
+            previous += delta;
+            *output++ = (uint16_t)previous;
+        }
+    }
+    return true;
+}
+
 /* report a zlib or i/o error */
 void zerr(int ret) {
     fputs("zpipe: ", stderr);
@@ -101,4 +244,477 @@ void zerr(int ret) {
     case Z_VERSION_ERROR:
         fputs("zlib version mismatch!\n", stderr);
     }
-}
\ No newline at end of file
+}
+
+namespace {
+
+class NoneCodec : public Codec {
+  public:
+    CodecId id() const override { return CodecId::NONE; }
+    std::string spec() const override { return "none"; }
+    int compress_bound(int input_length) const override {
+        return input_length;
+    }
+    int compress(const char *input, int input_length, char *output,
+                 int *output_length) const override {
+        if (*output_length < input_length)
+            return -1;
+        memcpy(output, input, input_length);
+        *output_length = input_length;
+        return 0;
+    }
+    int decompress(const char *input, int input_length, char *output,
+                   int *output_length) const override {
+        return compress(input, input_length, output, output_length);
+    }
+};
+
+class ZlibCodec : public Codec {
+  public:
+    explicit ZlibCodec(int level_) : level(level_) {}
+    CodecId id() const override { return CodecId::ZLIB; }
+    std::string spec() const override {
+        return "zlib:" + std::to_string(level);
+    }
+    int compress_bound(int input_length) const override {
+        return compressBound(input_length);
+    }
+    int compress(const char *input, int input_length, char *output,
+                 int *output_length) const override {
+        return ::compress(input, input_length, output, output_length, level);
+    }
+    int decompress(const char *input, int input_length, char *output,
+                   int *output_length) const override {
+        return ::decompress(input, input_length, output, output_length);
+    }
+
+  private:
+    int level;
+};
+
+// One deflate stream and one inflate stream, each created by its first call
+// and kept until the codec is destroyed.
+class ZlibStreamCodec : public Codec {
+  public:
+    ZlibStreamCodec(int level_, const std::string &dictionary_)
+        : level(level_), dictionary(dictionary_) {}
+    ~ZlibStreamCodec() override {
+        if (deflating)
+            deflateEnd(&deflater);
+        if (inflating)
+            inflateEnd(&inflater);
+    }
+    CodecId id() const override { return CodecId::ZLIB_STREAM; }
+    std::string spec() const override {
+        return "zlib:" + std::to_string(level) + " stream";
+    }
+    int compress_bound(int input_length) const override {
+        // Room for the zlib header and the empty block of the sync flush.
+        return compressBound(input_length) + 16;
+    }
+    int compress(const char *input, int input_length, char *output,
+                 int *output_length) const override {
+        // deflate makes no progress on no input after a flush, and fails.
+        if (input_length == 0) {
+            *output_length = 0;
+            return 0;
+        }
+        if (!deflating) {
+            memset(&deflater, 0, sizeof(deflater));
+            if (deflateInit(&deflater, level) != Z_OK)
+                return -1;
+            deflating = true;
+            if (!dictionary.empty() &&
+                deflateSetDictionary(&deflater,
+                                     (const Bytef *)dictionary.data(),
+                                     dictionary.size()) != Z_OK)
+                return -1;
+        }
+        deflater.next_in = (Bytef *)input;
+        deflater.avail_in = input_length;
+        deflater.next_out = (Bytef *)output;
+        deflater.avail_out = *output_length;
+        // The sync flush ends the output on a byte boundary, so the receiver
+        // can inflate all of it without the next frame.
+        const int ret = deflate(&deflater, Z_SYNC_FLUSH);
+        if (ret != Z_OK || deflater.avail_in != 0 || deflater.avail_out == 0)
+            return -1;
+        *output_length -= deflater.avail_out;
+        return 0;
+    }
+    int decompress(const char *input, int input_length, char *output,
+                   int *output_length) const override {
+        // As compress, leaves the stream alone for an empty section.
+        if (input_length == 0) {
+            *output_length = 0;
+            return 0;
+        }
+        if (!inflating) {
+            memset(&inflater, 0, sizeof(inflater));
+            if (inflateInit(&inflater) != Z_OK)
+                return -1;
+            inflating = true;
+        }
+        inflater.next_in = (Bytef *)input;
+        inflater.avail_in = input_length;
+        inflater.next_out = (Bytef *)output;
+        inflater.avail_out = *output_length;
+        int ret = inflate(&inflater, Z_SYNC_FLUSH);
+        if (ret == Z_NEED_DICT) {
+            if (inflateSetDictionary(&inflater,
+                                     (const Bytef *)dictionary.data(),
+                                     dictionary.size()) != Z_OK)
+                return -1;
+            ret = inflate(&inflater, Z_SYNC_FLUSH);
+        }
+        // With the output full, the empty block of the flush may be left.
+        if (ret == Z_OK && inflater.avail_in != 0)
+            ret = inflate(&inflater, Z_SYNC_FLUSH);
+        if (ret != Z_OK || inflater.avail_in != 0)
+            return -1;
+        *output_length -= inflater.avail_out;
+        return 0;
+    }
+
+  private:
+    int level;
+    std::string dictionary;
+    mutable z_stream deflater, inflater;
+    mutable bool deflating = false, inflating = false;
+};
+
+// Delta and bit-packing of 16-bit samples. It has no level and fails on input
+// of an odd length.
+class BitpackCodec : public Codec {
+  public:
+    CodecId id() const override { return CodecId::BITPACK; }
+    std::string spec() const override { return "bitpack"; }
+    int compress_bound(int input_length) const override {
+        return bitpack::encode_bound(input_length / sizeof(uint16_t));
+    }
+    int compress(const char *input, int input_length, char *output,
+                 int *output_length) const override {
+        if (input_length % sizeof(uint16_t) != 0 ||
+            *output_length < compress_bound(input_length))
+            return -1;
+        *output_length =
+            bitpack::encode((const uint16_t *)input,
+                            input_length / sizeof(uint16_t), (uint8_t *)output);
+        return 0;
+    }
+    int decompress(const char *input, int input_length, char *output,
+                   int *output_length) const override {
+        if (*output_length % sizeof(uint16_t) != 0)
+            return -1;
+        if (!bitpack::decode((const uint8_t *)input, input_length,
+                             (uint16_t *)output,
+                             *output_length / sizeof(uint16_t)))
+            return -1;
+        return 0;
+    }
+};
+
+class RvlCodec : public Codec {
+  public:
+    CodecId id() const override { return CodecId::RVL; }
+    std::string spec() const override { return "rvl"; }
+    int compress_bound(int input_length) const override {
+        return rvl_bound(input_length / sizeof(uint16_t));
+    }
+    int compress(const char *input, int input_length, char *output,
+                 int *output_length) const override {
+        if (input_length % sizeof(uint16_t) != 0 ||
+            *output_length < compress_bound(input_length))
+            return -1;
+        *output_length = compress_rvl((const uint16_t *)input,
+                                      input_length / sizeof(uint16_t), output);
+        return 0;
+    }
+    int decompress(const char *input, int input_length, char *output,
+                   int *output_length) const override {
+        if (*output_length % sizeof(uint16_t) != 0)
+            return -1;
+        if (!decompress_rvl(input, input_length, (uint16_t *)output,
+                            *output_length / sizeof(uint16_t)))
+            return -1;
+        return 0;
+    }
+};
+
+#ifdef HAVE_LZ4
+// The level is the acceleration of LZ4_compress_fast. 1 is LZ4's default and
+// larger values trade ratio for speed.
+class Lz4Codec : public Codec {
+  public:
+    explicit Lz4Codec(int acceleration_) : acceleration(acceleration_) {}
+    CodecId id() const override { return CodecId::LZ4; }
+    std::string spec() const override {
+        return "lz4:" + std::to_string(acceleration);
+    }
+    int compress_bound(int input_length) const override {
+        return LZ4_compressBound(input_length);
+    }
+    int compress(const char *input, int input_length, char *output,
+                 int *output_length) const override {
+        int ret = LZ4_compress_fast(input, output, input_length,
+                                    *output_length, acceleration);
+        if (ret <= 0)
+            return -1;
+        *output_length = ret;
+        return 0;
+    }
+    int decompress(const char *input, int input_length, char *output,
+                   int *output_length) const override {
+        int ret =
+            LZ4_decompress_safe(input, output, input_length, *output_length);
+        if (ret < 0)
+            return -1;
+        *output_length = ret;
+        return 0;
+    }
+
+  private:
+    int acceleration;
+};
+#endif
+
+#ifdef HAVE_ZSTD
+class ZstdCodec : public Codec {
+  public:
+    explicit ZstdCodec(int level_) : level(level_) {}
+    CodecId id() const override { return CodecId::ZSTD; }
+    std::string spec() const override {
+        return "zstd:" + std::to_string(level);
+    }
+    int compress_bound(int input_length) const override {
+        return ZSTD_compressBound(input_length);
+    }
+    int compress(const char *input, int input_length, char *output,
+                 int *output_length) const override {
+        // Contexts are expensive to create, so each thread keeps one.
+        thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> cctx(
+            ZSTD_createCCtx(), ZSTD_freeCCtx);
+        size_t ret = ZSTD_compressCCtx(cctx.get(), output, *output_length,
+                                       input, input_length, level);
+        if (ZSTD_isError(ret))
+            return -1;
+        *output_length = ret;
+        return 0;
+    }
+    int decompress(const char *input, int input_length, char *output,
+                   int *output_length) const override {
+        thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> dctx(
+            ZSTD_createDCtx(), ZSTD_freeDCtx);
+        size_t ret = ZSTD_decompressDCtx(dctx.get(), output, *output_length,
+                                         input, input_length);
+        if (ZSTD_isError(ret))
+            return -1;
+        *output_length = ret;
+        return 0;
+    }
+
+  private:
+    int level;
+};
+
+// One compression and one decompression context. Each call ends with
+// ZSTD_e_flush, which keeps the zstd frame open and its window with it.
+class ZstdStreamCodec : public Codec {
+  public:
+    ZstdStreamCodec(int level_, const std::string &dictionary_)
+        : level(level_), dictionary(dictionary_), cctx(nullptr, ZSTD_freeCCtx),
+          dctx(nullptr, ZSTD_freeDCtx) {}
+    CodecId id() const override { return CodecId::ZSTD_STREAM; }
+    std::string spec() const override {
+        return "zstd:" + std::to_string(level) + " stream";
+    }
+    int compress_bound(int input_length) const override {
+        // Room for the frame header and the block header of the flush.
+        return ZSTD_compressBound(input_length) + 32;
+    }
+    int compress(const char *input, int input_length, char *output,
+                 int *output_length) const override {
+        if (!cctx) {
+            cctx.reset(ZSTD_createCCtx());
+            if (!cctx ||
+                ZSTD_isError(ZSTD_CCtx_setParameter(
+                    cctx.get(), ZSTD_c_compressionLevel, level)))
+                return -1;
+            if (!dictionary.empty() &&
+                ZSTD_isError(ZSTD_CCtx_loadDictionary(
+                    cctx.get(), dictionary.data(), dictionary.size())))
+                return -1;
+        }
+        ZSTD_inBuffer in = {input, (size_t)input_length, 0};
+        ZSTD_outBuffer out = {output, (size_t)*output_length, 0};
+        size_t remaining;
+        do {
+            remaining =
+                ZSTD_compressStream2(cctx.get(), &out, &in, ZSTD_e_flush);
+            if (ZSTD_isError(remaining))
+                return -1;
+        } while (remaining != 0 && out.pos < out.size);
+        if (remaining != 0)
+            return -1;
+        *output_length = out.pos;
+        return 0;
+    }
+    int decompress(const char *input, int input_length, char *output,
+                   int *output_length) const override {
+        if (!dctx) {
+            dctx.reset(ZSTD_createDCtx());
+            if (!dctx)
+                return -1;
+            if (!dictionary.empty() &&
+                ZSTD_isError(ZSTD_DCtx_loadDictionary(
+                    dctx.get(), dictionary.data(), dictionary.size())))
+                return -1;
+        }
+        ZSTD_inBuffer in = {input, (size_t)input_length, 0};
+        ZSTD_outBuffer out = {output, (size_t)*output_length, 0};
+        while (in.pos < in.size) {
+            const size_t in_pos = in.pos, out_pos = out.pos;
+            if (ZSTD_isError(ZSTD_decompressStream(dctx.get(), &out, &in)))
+                return -1;
+            // No progress means that the output is too small.
+            if (in.pos == in_pos && out.pos == out_pos)
+                return -1;
+        }
+        *output_length = out.pos;
+        return 0;
+    }
+
+  private:
+    int level;
+    std::string dictionary;
+    mutable std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> cctx;
+    mutable std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> dctx;
+};
+#endif
+
+struct CodecBackend {
+    const char *name;
+    CodecId id;
+    int default_level, min_level, max_level;
+    std::shared_ptr<Codec> (*make)(int level);
+    // The stateful variant of the codec, or nullptr when it has none.
+    CodecId stream_id;
+    std::shared_ptr<Codec> (*make_stream)(int level,
+                                          const std::string &dictionary);
+};
+
+const CodecBackend codec_backends[] = {
+    {"none", CodecId::NONE, 0, 0, 0,
+     [](int) -> std::shared_ptr<Codec> {
+         return std::make_shared<NoneCodec>();
+     },
+     CodecId::NONE, nullptr},
+    {"zlib", CodecId::ZLIB, 6, 0, 9,
+     [](int level) -> std::shared_ptr<Codec> {
+         return std::make_shared<ZlibCodec>(level);
+     },
+     CodecId::ZLIB_STREAM,
+     [](int level, const std::string &dictionary) -> std::shared_ptr<Codec> {
+         return std::make_shared<ZlibStreamCodec>(level, dictionary);
+     }},
+    {"bitpack", CodecId::BITPACK, 0, 0, 0,
+     [](int) -> std::shared_ptr<Codec> {
+         return std::make_shared<BitpackCodec>();
+     },
+     CodecId::NONE, nullptr},
+    {"rvl", CodecId::RVL, 0, 0, 0,
+     [](int) -> std::shared_ptr<Codec> {
+         return std::make_shared<RvlCodec>();
+     },
+     CodecId::NONE, nullptr},
+#ifdef HAVE_LZ4
+    {"lz4", CodecId::LZ4, 1, 1, 65537,
+     [](int level) -> std::shared_ptr<Codec> {
+         return std::make_shared<Lz4Codec>(level);
+     },
+     CodecId::NONE, nullptr},
+#endif
+#ifdef HAVE_ZSTD
+    {"zstd", CodecId::ZSTD, 3, ZSTD_minCLevel(), ZSTD_maxCLevel(),
+     [](int level) -> std::shared_ptr<Codec> {
+         return std::make_shared<ZstdCodec>(level);
+     },
+     CodecId::ZSTD_STREAM,
+     [](int level, const std::string &dictionary) -> std::shared_ptr<Codec> {
+         return std::make_shared<ZstdStreamCodec>(level, dictionary);
+     }},
+#endif
+};
+
+// Finds the backend of spec and its level.
+const CodecBackend &parse_spec(const std::string &spec, int &level) {
+    std::string name = spec.substr(0, spec.find(':'));
+    for (const auto &backend : codec_backends) {
+        if (name != backend.name)
+            continue;
+        level = backend.default_level;
+        if (name.size() < spec.size()) {
+            size_t pos;
+            try {
+                level = std::stoi(spec.substr(name.size() + 1), &pos);
+            } catch (const std::out_of_range &) {
+                throw std::invalid_argument("Codec level out of range: " +
+                                            spec);
+            }
+            if (name.size() + 1 + pos != spec.size())
+                throw std::invalid_argument("Invalid codec level: " + spec);
+        }
+        if (level < backend.min_level || backend.max_level < level)
+            throw std::invalid_argument("Codec level out of range: " + spec);
+        return backend;
+    }
+    throw std::invalid_argument("Unknown or unavailable codec: " + spec);
+}
+
+} // namespace
+
+std::shared_ptr<Codec> make_codec(const std::string &spec) {
+    int level;
+    const CodecBackend &backend = parse_spec(spec, level);
+    return backend.make(level);
+}
+
+std::shared_ptr<Codec> make_stream_codec(const std::string &spec,
+                                         const std::string &dictionary) {
+    int level;
+    const CodecBackend &backend = parse_spec(spec, level);
+    if (!backend.make_stream)
+        return backend.make(level);
+    return backend.make_stream(level, dictionary);
+}
+
+std::shared_ptr<Codec> make_stream_decoder(CodecId id,
+                                           const std::string &dictionary) {
+    for (const auto &backend : codec_backends) {
+        if (backend.make_stream && backend.stream_id == id)
+            return backend.make_stream(backend.default_level, dictionary);
+    }
+    return nullptr;
+}
+
+const Codec *codec_for_id(CodecId id) {
+    // Decoding does not depend on the level.
+    static const std::vector<std::shared_ptr<Codec>> decoders = [] {
+        std::vector<std::shared_ptr<Codec>> v;
+        for (const auto &backend : codec_backends)
+            v.push_back(backend.make(backend.default_level));
+        return v;
+    }();
+    for (const auto &decoder : decoders) {
+        if (decoder->id() == id)
+            return decoder.get();
+    }
+    return nullptr;
+}
+
+std::vector<std::string> available_codecs() {
+    std::vector<std::string> names;
+    for (const auto &backend : codec_backends)
+        names.push_back(backend.name);
+    return names;
+}
@@ -1,3 +1,90 @@
-int compress(char *input, int input_length, char *output, int *output_length);
+#pragma once
 
-int decompress(char *input, int input_length, char *output, int *output_length);
\ No newline at end of file
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// zlib in one call. *output_length is the capacity of output on entry and the
+// length of the result on return. Both return Z_OK on success.
+int compress(const char *input, int input_length, char *output,
+             int *output_length, int level);
+
+int decompress(const char *input, int input_length, char *output,
+               int *output_length);
+
+// RVL (Wilson, "Fast Lossless Depth Image Compression", 2017) for 16-bit depth
+// images. Alternating runs of zeros and of non-zero pixels, whose deltas are
+// zigzag-encoded, all as variable-length codes of 3-bit nibbles. The output
+// is a sequence of 32-bit words. It fits in rvl_bound(n_pixels) bytes.
+// compress_rvl returns the length of the output. decompress_rvl returns false
+// when the input does not decode to exactly n_pixels pixels.
+int rvl_bound(int n_pixels);
+int compress_rvl(const uint16_t *input, int n_pixels, char *output);
+bool decompress_rvl(const char *input, int input_length, uint16_t *output,
+                    int n_pixels);
+
+// Identifies the codec of a section payload on the wire.
+enum class CodecId : uint32_t {
+    NONE = 0,
+    ZLIB = 1,
+    LZ4 = 2,
+    ZSTD = 3,
+    BITPACK = 4,
+    RVL = 5,
+    // The streams of make_stream_codec.
+    ZLIB_STREAM = 6,
+    ZSTD_STREAM = 7,
+};
+
+// A lossless codec for section payloads. A codec keeps nothing but its
+// settings, so one instance can be used from several threads at once, except
+// for the streams of make_stream_codec.
+class Codec {
+  public:
+    virtual ~Codec() {}
+
+    virtual CodecId id() const = 0;
+
+    // The name and the level in the form make_codec accepts.
+    virtual std::string spec() const = 0;
+
+    // The largest compressed length of input_length bytes.
+    virtual int compress_bound(int input_length) const = 0;
+
+    // Both return 0 on success. *output_length is the capacity of output on
+    // entry and the length of the result on return.
+    virtual int compress(const char *input, int input_length, char *output,
+                         int *output_length) const = 0;
+    virtual int decompress(const char *input, int input_length, char *output,
+                           int *output_length) const = 0;
+};
+
+// Makes a codec from "name" or "name:level", e.g. "zlib:6", "lz4", "zstd:3",
+// "bitpack", "rvl" or "none". bitpack and rvl only take arrays of 16-bit
+// samples. Throws
+// std::invalid_argument when the name is unknown, the level is out of range or
+// the backend is not compiled in.
+std::shared_ptr<Codec> make_codec(const std::string &spec);
+
+// A codec which keeps its history across calls, so that every payload of a
+// channel can refer to the ones before it. Each call ends with a flush, so its
+// output decodes as soon as it arrives, given all the earlier outputs in
+// order. A stream is stateful and serves one channel in one direction. The
+// dictionary primes the history of a new stream and must be the same at both
+// ends. Makes the ordinary codec when the backend has no streaming mode, and
+// throws like make_codec.
+std::shared_ptr<Codec> make_stream_codec(const std::string &spec,
+                                         const std::string &dictionary);
+
+// A new stream which decodes payloads tagged with id, or nullptr when id is
+// not a stream or its backend is not compiled in.
+std::shared_ptr<Codec> make_stream_decoder(CodecId id,
+                                           const std::string &dictionary);
+
+// The codec which decodes payloads tagged with id, or nullptr when it is not
+// compiled in or id is a stream.
+const Codec *codec_for_id(CodecId id);
+
+// Names of the backends compiled into this binary.
+std::vector<std::string> available_codecs();
@@ -1,26 +1,103 @@
 #include "connector.h"
 
 #include "compress.h"
-
+#include "datagram_transport.h"
+#include "frame_format.h"
+#include "frame_parser.h"
+#include "frame_sender.h"
+#include "jpeg_codec.h"
+#include "rate_controller.h"
+#include "reactor.h"
+#include "ring_buffer.h"
+#include "rle.h"
+#include "send_queue.h"
+#include "worker_pool.h"
+
+#include <librealsense2/rsutil.h>
 #include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
 #include <arpa/inet.h>
 #include <cassert>
 #include <netinet/in.h>
-#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
+#include <thread>
+#include <tuple>
 
 namespace connector {
 
-const double ABS_MAX_16SU = (1 << 12) - 1;
+using frame_format::Calibration;
+using frame_format::FRAME_FLAG_CALIBRATION;
+using frame_format::FRAME_FLAG_KEYFRAME_REQUEST;
+using frame_format::FRAME_FLAG_STREAM_RESET;
+using frame_format::FrameHeader;
+using frame_format::Quantizer;
+using frame_format::Region;
+using frame_format::section_name;
+using frame_format::SectionHeader;
+using frame_format::SectionType;
+using frame_format::SerializedFrame;
+using predict::Predictor;
+
+struct SenderSession {
+    bool calibration_sent = false;
+    // Send the calibration with every frame, for transports which may lose
+    // the first one.
+    bool repeat_calibration = false;
+    // The codec of each compressed section type, made by make_codecs from
+    // the spec of each.
+    std::map<SectionType, std::shared_ptr<Codec>> codecs;
+    std::map<SectionType, std::string> codec_specs;
+    // Compress each section type as one stream, which restarts at every
+    // keyframe.
+    bool codec_streams = false;
+    std::string codec_dictionary;
+    // The predictor of 16-bit images.
+    Predictor predictor = Predictor::ADAPTIVE;
+
+    int keyframe_interval = 1;
+    int temporal_step = 1;
+    // Set by the rate controller.
+    int jpeg_quality = 95;
+    jpeg_codec::Subsampling jpeg_subsampling = jpeg_codec::Subsampling::S420;
+    ColorCodec color_codec = ColorCodec::JPEG;
+    std::unique_ptr<video_codec::Encoder> color_encoder;
+    QuantizerMode quantizer = QuantizerMode::RANGE;
+    int quantization_bits = 12;
+    float quantization_step = 0.001f;
+    bool face_roi = false;
+    int background_scale = 1;
+    int background_jpeg_quality = 100;
+    int background_depth_step = 1;
+    // The depth image the receiver has reconstructed from the frames sent so
+    // far. Empty until the first keyframe.
+    std::vector<uint16_t> reference_depth;
+    int frames_since_keyframe = 0;
+    bool keyframe_requested = false;
+    // Reused by every frame.
+    std::vector<std::shared_ptr<SerializedFrame>> serialized_frames;
+    std::vector<SectionHeader> sections;
+    // Emptied after every frame but keep their capacity. A std::function
+    // still allocates when its captures do not fit in it, and so does the
+    // shared state of every future.
+    std::vector<std::function<void(SectionHeader &, std::vector<uint8_t> &)>>
+        encoders;
+    std::vector<std::future<void>> pending;
+    std::vector<uint32_t> valid;
+};
 
 void print_mat_u8(const cv::Mat &mat) {
     for (int i = 0; i < mat.rows; i++) {
@@ -40,346 +117,788 @@ void print_mat_u16(const cv::Mat &mat) {
     }
 }
 
-uint32_t serialize_frame_data(camera::rs2_frame_data frame, char *buf) {
-    char *p = buf;
-
-    // I write the length of this frame at the last.
-    p += sizeof(uint32_t);
-
-    *((uint32_t *)p) = frame.height;
-    p += sizeof(uint32_t);
-
-    *((uint32_t *)p) = frame.width;
-    p += sizeof(uint32_t);
-
-    *((uint32_t *)p) = frame.n_points;
-    p += sizeof(uint32_t);
-
-    char *compress_output =
-        (char *)malloc(frame.n_points * sizeof(rs2::vertex));
-    int compress_length;
-
-    // RGB
-    {
-        cv::Mat rgb_image(frame.height, frame.width, CV_8UC3, frame.rgb.get());
-
-        std::vector<uchar> jpeg_buf;
-        cv::imencode(".jpg", rgb_image, jpeg_buf);
-        LOG(INFO) << "The size of jpeg_buf = " << jpeg_buf.size();
-        *((uint32_t *)p) = jpeg_buf.size();
-        p += sizeof(uint32_t);
-        memcpy(p, jpeg_buf.data(), jpeg_buf.size());
-        p += jpeg_buf.size();
-    }
-
-    // XYZ
-    {
-        cv::Mat xyz_image(frame.height, frame.width, CV_32FC3,
-                          frame.vertices.get());
-        cv::Mat x32f(frame.height, frame.width, CV_32FC1);
-        cv::Mat y32f(frame.height, frame.width, CV_32FC1);
-        cv::Mat z32f(frame.height, frame.width, CV_32FC1);
-
-        cv::Mat out_xyz[] = {x32f, y32f, z32f};
-        int from_to_xyz[] = {0, 0, 1, 1, 2, 2};
-        mixChannels(&xyz_image, 1, out_xyz, 3, from_to_xyz, 3);
-
-        // Normalization
-        double max_x, min_x, max_y, min_y, max_z, min_z;
-        cv::minMaxLoc(x32f, &min_x, &max_x);
-        cv::minMaxLoc(y32f, &min_y, &max_y);
-        cv::minMaxLoc(z32f, &min_z, &max_z);
-
-        x32f = x32f - min_x;
-        y32f = y32f - min_y;
-        z32f = z32f - min_z;
-
-        std::shared_ptr<cv::Mat> x16u =
-            std::make_shared<cv::Mat>(cv::Mat(x32f.rows, x32f.cols, CV_16SC1));
-        std::shared_ptr<cv::Mat> y16u =
-            std::make_shared<cv::Mat>(cv::Mat(y32f.rows, y32f.cols, CV_16SC1));
-        std::shared_ptr<cv::Mat> z16u =
-            std::make_shared<cv::Mat>(cv::Mat(z32f.rows, z32f.cols, CV_16SC1));
-        x32f.convertTo(*x16u, CV_16SC1, ABS_MAX_16SU / (max_x - min_x));
-        y32f.convertTo(*y16u, CV_16SC1, ABS_MAX_16SU / (max_y - min_y));
-        z32f.convertTo(*z16u, CV_16SC1, ABS_MAX_16SU / (max_z - min_z));
-
-        compress((char *)(*x16u).data,
-                 frame.height * frame.width * sizeof(uint16_t), compress_output,
-                 &compress_length);
-        LOG(INFO) << "x: original size = "
-                  << frame.height * frame.width * sizeof(uint16_t)
-                  << ", compressed size = " << compress_length;
-
-        *((float *)p) = (float)((max_x - min_x) / ABS_MAX_16SU);
-        p += sizeof(float);
-        *((float *)p) = (float)min_x;
-        p += sizeof(float);
-        *((uint32_t *)p) = compress_length;
-        p += sizeof(uint32_t);
-        memcpy(p, compress_output, compress_length);
-        p += compress_length;
-
-        compress((char *)(*y16u).data,
-                 frame.height * frame.width * sizeof(uint16_t), compress_output,
-                 &compress_length);
-        LOG(INFO) << "y: original size = "
-                  << frame.height * frame.width * sizeof(uint16_t)
-                  << ", compressed size = " << compress_length;
-
-        *((float *)p) = (float)((max_y - min_y) / ABS_MAX_16SU);
-        p += sizeof(float);
-        *((float *)p) = (float)min_y;
-        p += sizeof(float);
-        *((uint32_t *)p) = compress_length;
-        p += sizeof(uint32_t);
-        memcpy(p, compress_output, compress_length);
-        p += compress_length;
-
-        compress((char *)(*z16u).data,
-                 frame.height * frame.width * sizeof(uint16_t), compress_output,
-                 &compress_length);
-        LOG(INFO) << "z: original size = "
-                  << frame.height * frame.width * sizeof(uint16_t)
-                  << ", compressed size = " << compress_length;
-        *((float *)p) = (float)((max_z - min_z) / ABS_MAX_16SU);
-        p += sizeof(float);
-        *((float *)p) = (float)min_z;
-        p += sizeof(float);
-        *((uint32_t *)p) = compress_length;
-        p += sizeof(uint32_t);
-        memcpy(p, compress_output, compress_length);
-        p += compress_length;
-    }
-
-    // UV
-    {
-        cv::Mat uv_image(frame.height, frame.width, CV_32FC2,
-                         frame.texture_coordinates.get());
-        cv::Mat u32f(frame.height, frame.width, CV_32FC1);
-        cv::Mat v32f(frame.height, frame.width, CV_32FC1);
-
-        cv::Mat out_uv[] = {u32f, v32f};
-        int from_to_uv[] = {0, 0, 1, 1};
-        mixChannels(&uv_image, 1, out_uv, 2, from_to_uv, 2);
-
-        // Normalization
-        double max_u, min_u, max_v, min_v;
-        cv::minMaxLoc(u32f, &min_u, &max_u);
-        cv::minMaxLoc(v32f, &min_v, &max_v);
-
-        u32f = u32f - min_u;
-        v32f = v32f - min_v;
-
-        std::shared_ptr<cv::Mat> u16u =
-            std::make_shared<cv::Mat>(cv::Mat(u32f.rows, u32f.cols, CV_16SC1));
-        std::shared_ptr<cv::Mat> v16u =
-            std::make_shared<cv::Mat>(cv::Mat(v32f.rows, v32f.cols, CV_16SC1));
-        u32f.convertTo(*u16u, CV_16SC1, frame.width / (max_u - min_u));
-        v32f.convertTo(*v16u, CV_16SC1, frame.height / (max_v - min_v));
-
-        compress((char *)(*u16u).data,
-                 frame.height * frame.width * sizeof(uint16_t), compress_output,
-                 &compress_length);
-        LOG(INFO) << "u: original size = "
-                  << frame.height * frame.width * sizeof(uint16_t)
-                  << ", compressed size = " << compress_length;
-        *((float *)p) = (float)((max_u - min_u) / frame.width);
-        p += sizeof(float);
-        *((float *)p) = (float)min_u;
-        p += sizeof(float);
-        *((uint32_t *)p) = compress_length;
-        p += sizeof(uint32_t);
-        memcpy(p, compress_output, compress_length);
-        p += compress_length;
-
-        compress((char *)(*v16u).data,
-                 frame.height * frame.width * sizeof(uint16_t), compress_output,
-                 &compress_length);
-        LOG(INFO) << "v: original size = "
-                  << frame.height * frame.width * sizeof(uint16_t)
-                  << ", compressed size = " << compress_length;
-        *((float *)p) = (float)((max_v - min_v) / frame.height);
-        p += sizeof(float);
-        *((float *)p) = (float)min_v;
-        p += sizeof(float);
-        *((uint32_t *)p) = compress_length;
-        p += sizeof(uint32_t);
-        memcpy(p, compress_output, compress_length);
-        p += compress_length;
-    }
-
-    // Write the size of compressed frame to the head.
-    *((uint32_t *)buf) = p - buf;
-
-    free(compress_output);
-
-    return p - buf;
+void compress_payload(const Codec &codec, const void *input, int input_length,
+                      std::vector<uint8_t> &payload) {
+    payload.resize(codec.compress_bound(input_length));
+    int compress_length = payload.size();
+    if (codec.compress((const char *)input, input_length,
+                       (char *)payload.data(), &compress_length) != 0) {
+        LOG(FATAL) << codec.spec() << " failed to compress " << input_length
+                   << " bytes";
+    }
+    payload.resize(compress_length);
+}
+
+// Compresses the prediction residuals of a 16-bit image.
+void compress_image(const Codec &codec, Predictor predictor,
+                    const uint16_t *image, int width, int height,
+                    std::vector<uint8_t> &payload) {
+    if (predictor == Predictor::NONE) {
+        compress_payload(codec, image, width * height * sizeof(uint16_t),
+                         payload);
+        return;
+    }
+    // Sections encode on the pool, so each thread has its own.
+    thread_local std::vector<uint16_t> filtered;
+    filtered.resize(predict::filtered_length(predictor, width, height));
+    predict::filter(predictor, image, width, height, filtered.data());
+    compress_payload(codec, filtered.data(), filtered.size() * sizeof(uint16_t),
+                     payload);
+}
+
+// How encode_channel maps the samples of a channel to 16 bits. With step > 0
+// the samples are quantized to multiples of step above their minimum,
+// otherwise to `levels` steps over their range. INVERSE quantizes 1 / sample.
+struct ChannelQuantizer {
+    Quantizer quantizer = Quantizer::LINEAR;
+    double levels = 0.0;
+    double step = 0.0;
+};
+
+// Quantizes one channel of the valid points of an interleaved float image and
+// compresses it. Only the valid points are coded, but they are predicted on
+// the grid of the image, with the holes filled from their neighbours, so that
+// the predictors have a row above.
+void encode_channel(const cv::Mat &image, int channel,
+                    const std::vector<uint32_t> &valid,
+                    const ChannelQuantizer &quantizer, SectionType type,
+                    const Codec &codec, Predictor predictor,
+                    SectionHeader &section, std::vector<uint8_t> &payload) {
+    const int n_valid = valid.size();
+    const float *samples = (const float *)image.data;
+    const int n_channels = image.channels();
+    thread_local std::vector<float> values;
+    thread_local std::vector<uint16_t> quantized;
+    values.resize(n_valid);
+    quantized.resize(n_valid);
+    cv::Mat c32f(1, n_valid, CV_32FC1, values.data());
+    float *gathered = values.data();
+    for (int i = 0; i < n_valid; i++) {
+        gathered[i] = samples[(size_t)valid[i] * n_channels + channel];
+    }
+    if (quantizer.quantizer == Quantizer::INVERSE) {
+        // Valid points have z != 0.
+        for (int i = 0; i < n_valid; i++) {
+            gathered[i] = 1.0f / gathered[i];
+        }
+    }
+
+    // Normalization
+    double max_c = 0.0, min_c = 0.0;
+    if (n_valid > 0) {
+        auto [min_it, max_it] =
+            std::minmax_element(gathered, gathered + n_valid);
+        min_c = *min_it;
+        max_c = *max_it;
+    }
+    double step = quantizer.step;
+    if (step <= 0.0) {
+        step = (max_c - min_c) / quantizer.levels;
+    } else if ((max_c - min_c) / step > 0xffff) {
+        // The range does not fit in 16 bits at this step. The step is widened
+        // and the error bound does not hold for this frame.
+        LOG(WARNING) << section_name(type) << ": range " << max_c - min_c
+                     << " does not fit in 16 bits with step " << step;
+        step = (max_c - min_c) / 0xffff;
+    }
+    const double scale = step > 0.0 ? 1.0 / step : 0.0;
+
+    cv::Mat c16u(1, n_valid, CV_16UC1, quantized.data());
+    c32f.convertTo(c16u, CV_16UC1, scale, -min_c * scale);
+
+    const int original_length = image.rows * image.cols * sizeof(uint16_t);
+    if (predictor == Predictor::NONE) {
+        compress_payload(codec, quantized.data(), n_valid * sizeof(uint16_t),
+                         payload);
+    } else {
+        thread_local std::vector<uint16_t> grid;
+        thread_local std::vector<uint16_t> filtered;
+        grid.resize((size_t)image.rows * image.cols);
+        for (int i = 0; i < n_valid; i++) {
+            grid[valid[i]] = quantized[i];
+        }
+        filtered.resize(
+            predict::filtered_sparse_length(predictor, n_valid, image.rows));
+        predict::filter_sparse(predictor, grid.data(), image.cols, image.rows,
+                               valid.data(), n_valid, filtered.data());
+        compress_payload(codec, filtered.data(),
+                         filtered.size() * sizeof(uint16_t), payload);
+    }
+
+    section.type = type;
+    section.codec = codec.id();
+    section.predictor = predictor;
+    section.quantizer = quantizer.quantizer;
+    section.magnification = (float)step;
+    section.bias = (float)min_c;
+    section.length = payload.size();
+    LOG(INFO) << section_name(type) << ": original size = " << original_length
+              << ", valid points = " << n_valid
+              << ", compressed size = " << payload.size() << " with "
+              << codec.spec() << ", " << predict::predictor_name(predictor);
+}
+
+void encode_rgb_video(const camera::rs2_frame_data &frame, int quality,
+                      bool keyframe, video_codec::Encoder &encoder,
+                      SectionHeader &section, std::vector<uint8_t> &payload) {
+    if (!encoder.encode(frame.rgb.get(), quality, keyframe, payload)) {
+        LOG(FATAL) << "Failed to encode the color image";
+    }
+    section = {SectionType::RGB_VP8, CodecId::NONE, Predictor::NONE,
+               Quantizer::LINEAR, 1.0f, 0.0f, (uint32_t)payload.size()};
+    LOG(INFO) << "rgb_vp8: size = " << payload.size() << " at quality "
+              << quality << (keyframe ? ", keyframe" : "");
+}
+
+// Finds the points with z != 0 and run-length codes the mask of them.
+void encode_validity(const camera::rs2_frame_data &frame,
+                     std::vector<uint32_t> &valid, SectionHeader &section,
+                     std::vector<uint8_t> &payload) {
+    const rs2::vertex *vertices = frame.vertices.get();
+    thread_local std::vector<uint8_t> mask;
+    mask.resize(frame.n_points);
+    valid.clear();
+    for (uint32_t i = 0; i < frame.n_points; i++) {
+        mask[i] = vertices[i].z != 0.0f;
+        if (mask[i]) {
+            valid.push_back(i);
+        }
+    }
+    rle::encode_mask(mask.data(), mask.size(), payload);
+    section = {SectionType::VALIDITY, CodecId::NONE, Predictor::NONE,
+               Quantizer::LINEAR, 1.0f, 0.0f, (uint32_t)payload.size()};
+    LOG(INFO) << "validity: valid points = " << valid.size() << " of "
+              << frame.n_points << ", size = " << payload.size();
+}
+
+// The color image, `scale` times smaller in both directions.
+void encode_rgb(const camera::rs2_frame_data &frame, int quality,
+                jpeg_codec::Subsampling subsampling, int scale,
+                SectionHeader &section, std::vector<uint8_t> &payload) {
+    const uint8_t *bgr = frame.rgb.get();
+    int width = frame.width, height = frame.height;
+    // create keeps the buffer while the frame size does not change.
+    thread_local cv::Mat small;
+    if (scale > 1) {
+        width = (width + scale - 1) / scale;
+        height = (height + scale - 1) / scale;
+        const cv::Mat image(frame.height, frame.width, CV_8UC3,
+                            frame.rgb.get());
+        cv::resize(image, small, cv::Size(width, height), 0, 0,
+                   cv::INTER_AREA);
+        bgr = small.data;
+    }
+    if (!jpeg_codec::encode(bgr, width, height, quality, subsampling,
+                            payload)) {
+        LOG(FATAL) << "Failed to encode the color image";
+    }
+    LOG(INFO) << "The size of jpeg_buf = " << payload.size()
+              << " at quality " << quality << ", "
+              << jpeg_codec::subsampling_name(subsampling) << ", 1/" << scale
+              << " scale";
+    section = {SectionType::RGB_JPEG, CodecId::NONE, Predictor::NONE,
+               Quantizer::LINEAR, (float)scale, 0.0f,
+               (uint32_t)payload.size()};
+}
+
+void encode_rgb_face(const camera::rs2_frame_data &frame, const Region &face,
+                     int quality, jpeg_codec::Subsampling subsampling,
+                     SectionHeader &section, std::vector<uint8_t> &payload) {
+    // The size of the face changes every frame, so the rows are copied into
+    // a vector, which keeps its capacity, rather than a cv::Mat.
+    thread_local std::vector<uint8_t> roi;
+    const size_t roi_row_length = 3 * face.width;
+    roi.resize(roi_row_length * face.height);
+    for (uint32_t y = 0; y < face.height; y++) {
+        memcpy(roi.data() + y * roi_row_length,
+               frame.rgb.get() + ((face.y + y) * frame.width + face.x) * 3,
+               roi_row_length);
+    }
+    if (!jpeg_codec::encode(roi.data(), face.width, face.height, quality,
+                            subsampling, payload)) {
+        LOG(FATAL) << "Failed to encode the face image";
+    }
+    LOG(INFO) << "rgb_face: " << face.width << "x" << face.height
+              << ", size = " << payload.size() << " at quality " << quality;
+    section = {SectionType::RGB_FACE_JPEG, CodecId::NONE, Predictor::NONE,
+               Quantizer::LINEAR, 1.0f, 0.0f, (uint32_t)payload.size()};
+}
+
+// The face grown by a margin for the hair and the ears, clipped to the frame.
+Region face_region(const cv::Rect &face, uint32_t width, uint32_t height) {
+    if (face.empty()) {
+        return {};
+    }
+    const cv::Rect grown(face.x - face.width / 4, face.y - face.height / 4,
+                         face.width * 3 / 2, face.height * 3 / 2);
+    const cv::Rect clipped = grown & cv::Rect(0, 0, width, height);
+    if (clipped.empty()) {
+        return {};
+    }
+    return {(uint32_t)clipped.x, (uint32_t)clipped.y, (uint32_t)clipped.width,
+            (uint32_t)clipped.height};
+}
+
+// The face region of the color image in depth pixels: the bounding box of the
+// depth samples which project into it, found with the calibration. Every
+// DEPTH_FACE_STEP-th sample of every DEPTH_FACE_STEP-th row is tried.
+Region depth_face_region(const camera::rs2_frame_data &frame,
+                         const Region &color_face) {
+    const uint32_t DEPTH_FACE_STEP = 4;
+    if (color_face.empty() || !frame.depth) {
+        return {};
+    }
+    const uint16_t *depth = frame.depth.get();
+    uint32_t x_begin = frame.width, y_begin = frame.height;
+    uint32_t x_end = 0, y_end = 0;
+    for (uint32_t y = 0; y < frame.height; y += DEPTH_FACE_STEP) {
+        for (uint32_t x = 0; x < frame.width; x += DEPTH_FACE_STEP) {
+            const uint16_t d = depth[y * frame.width + x];
+            if (d == 0) {
+                continue;
+            }
+            const float pixel[2] = {(float)x, (float)y};
+            float point[3];
+            float color_point[3];
+            float color_pixel[2];
+            rs2_deproject_pixel_to_point(point, &frame.depth_intrinsics,
+                                         pixel, d * frame.depth_scale);
+            rs2_transform_point_to_point(color_point, &frame.depth_to_color,
+                                         point);
+            rs2_project_point_to_pixel(color_pixel, &frame.color_intrinsics,
+                                       color_point);
+            if (color_pixel[0] < color_face.x ||
+                color_pixel[0] >= color_face.x + color_face.width ||
+                color_pixel[1] < color_face.y ||
+                color_pixel[1] >= color_face.y + color_face.height) {
+                continue;
+            }
+            x_begin = std::min(x_begin, x);
+            y_begin = std::min(y_begin, y);
+            x_end = std::max(x_end, x + DEPTH_FACE_STEP);
+            y_end = std::max(y_end, y + DEPTH_FACE_STEP);
+        }
+    }
+    if (x_end == 0) {
+        return {};
+    }
+    x_end = std::min(x_end, frame.width);
+    y_end = std::min(y_end, frame.height);
+    return {x_begin, y_begin, x_end - x_begin, y_end - y_begin};
+}
+
+// The depth image is 16 bits already, so it is sent as it is apart from the
+// background outside the face region, which is divided by background_step.
+void encode_depth(const camera::rs2_frame_data &frame, const Codec &codec,
+                  Predictor predictor, const Region &face, int background_step,
+                  SenderSession &session, SectionHeader &section,
+                  std::vector<uint8_t> &payload) {
+    if (background_step == 1) {
+        compress_image(codec, predictor, frame.depth.get(), frame.width,
+                       frame.height, payload);
+        session.reference_depth.assign(frame.depth.get(),
+                                       frame.depth.get() + frame.n_points);
+    } else {
+        const uint16_t *depth = frame.depth.get();
+        thread_local std::vector<uint16_t> quantized;
+        quantized.resize(frame.n_points);
+        session.reference_depth.resize(frame.n_points);
+        uint16_t *reference = session.reference_depth.data();
+        frame_format::for_each_depth_step(
+            face, frame.width, frame.height, 1, background_step,
+            [&](uint32_t i, int step) {
+                const int q = std::min((depth[i] + step / 2) / step, 0xffff);
+                quantized[i] = (uint16_t)q;
+                reference[i] = (uint16_t)std::min(q * step, 0xffff);
+            });
+        compress_image(codec, predictor, quantized.data(), frame.width,
+                       frame.height, payload);
+    }
+    section = {SectionType::DEPTH, codec.id(), predictor, Quantizer::LINEAR,
+               1.0f, (float)background_step, (uint32_t)payload.size()};
+    LOG(INFO) << "depth: original size = " << frame.n_points * sizeof(uint16_t)
+              << ", compressed size = " << payload.size() << " with "
+              << codec.spec() << ", " << predict::predictor_name(predictor);
 }
 
-camera::rs2_frame_data deserialize_frame_data(char *buf) {
-    camera::rs2_frame_data frame;
-    char *p = buf;
-
-    char *compress_output =
-        (char *)malloc(frame.n_points * sizeof(rs2::vertex));
-    int compress_length;
-
-    // Skip the first 4 bytes of the length of the serialized data.
-    p += sizeof(uint32_t);
-
-    frame.height = *((uint32_t *)p);
-    p += sizeof(uint32_t);
-
-    frame.width = *((uint32_t *)p);
-    p += sizeof(uint32_t);
-
-    frame.n_points = *((uint32_t *)p);
-    p += sizeof(uint32_t);
-
-    // Extract RGB information
-    // These memories are directly used as cv::Mat buffer.
-    {
-        uint32_t jpeg_size = *((uint32_t *)p);
-        p += sizeof(uint32_t);
-        std::vector<uchar> jpeg_buf(jpeg_size);
-        memcpy(jpeg_buf.data(), p, jpeg_size);
-        p += jpeg_size;
-
-        cv::Mat rgb_image = cv::imdecode(jpeg_buf, cv::IMREAD_COLOR);
-
-        std::shared_ptr<uint8_t> rgb_tmp(
-            new uint8_t[3 * frame.width * frame.height],
-            std::default_delete<uint8_t[]>());
-        frame.rgb = rgb_tmp;
-        memcpy(frame.rgb.get(), rgb_image.data,
-               sizeof(uint8_t) * 3 * frame.width * frame.height);
-    }
-
-    // XYZ
-    {
-        char *x16u_buf =
-            (char *)malloc(frame.width * frame.height * sizeof(uint16_t));
-        char *y16u_buf =
-            (char *)malloc(frame.width * frame.height * sizeof(uint16_t));
-        char *z16u_buf =
-            (char *)malloc(frame.width * frame.height * sizeof(uint16_t));
-
-        float x_magnification = *((float *)p);
-        p += sizeof(float);
-        float x_bias = *((float *)p);
-        p += sizeof(float);
-        uint32_t x_comp_length = *((uint32_t *)p);
-        p += sizeof(uint32_t);
-        int x_decomp_length = frame.width * frame.height * sizeof(uint16_t);
-        decompress(p, x_comp_length, x16u_buf, &x_decomp_length);
-        p += x_comp_length;
-        LOG(INFO) << "x_comp_length = " << x_comp_length
-                  << ", x_decomp_length = " << x_decomp_length;
-
-        float y_magnification = *((float *)p);
-        p += sizeof(float);
-        float y_bias = *((float *)p);
-        p += sizeof(float);
-        uint32_t y_comp_length = *((uint32_t *)p);
-        p += sizeof(uint32_t);
-        int y_decomp_length = frame.width * frame.height * sizeof(uint16_t);
-        decompress(p, y_comp_length, y16u_buf, &y_decomp_length);
-        p += y_comp_length;
-        LOG(INFO) << "y_comp_length = " << y_comp_length
-                  << ", y_decomp_length = " << y_decomp_length;
-
-        float z_magnification = *((float *)p);
-        p += sizeof(float);
-        float z_bias = *((float *)p);
-        p += sizeof(float);
-        uint32_t z_comp_length = *((uint32_t *)p);
-        p += sizeof(uint32_t);
-        int z_decomp_length = frame.width * frame.height * sizeof(uint16_t);
-        decompress(p, z_comp_length, z16u_buf, &z_decomp_length);
-        p += z_comp_length;
-        LOG(INFO) << "z_comp_length = " << z_comp_length
-                  << ", z_decomp_length = " << z_decomp_length;
-
-        cv::Mat x16u(frame.height, frame.width, CV_16SC1, x16u_buf);
-        cv::Mat y16u(frame.height, frame.width, CV_16SC1, y16u_buf);
-        cv::Mat z16u(frame.height, frame.width, CV_16SC1, z16u_buf);
-
-        cv::Mat x32f(frame.height, frame.width, CV_32FC1);
-        cv::Mat y32f(frame.height, frame.width, CV_32FC1);
-        cv::Mat z32f(frame.height, frame.width, CV_32FC1);
-        cv::Mat xyz_image(frame.height, frame.width, CV_32FC3);
-
-        x16u.convertTo(x32f, CV_32FC1, x_magnification, x_bias);
-        y16u.convertTo(y32f, CV_32FC1, y_magnification, y_bias);
-        z16u.convertTo(z32f, CV_32FC1, z_magnification, z_bias);
-
-        cv::Mat in_xyz[] = {x32f, y32f, z32f};
-        int from_to_xyz[] = {0, 0, 1, 1, 2, 2};
-        mixChannels(in_xyz, 3, &xyz_image, 1, from_to_xyz, 3);
-
-        std::shared_ptr<rs2::vertex> vertices_tmp(
-            new rs2::vertex[frame.n_points],
-            std::default_delete<rs2::vertex[]>());
-        frame.vertices = vertices_tmp;
-        memcpy(frame.vertices.get(), xyz_image.data,
-               sizeof(rs2::vertex) * frame.n_points);
-    }
-
-    // UV
-    {
-        char *u16u_buf =
-            (char *)malloc(frame.width * frame.height * sizeof(uint16_t));
-        char *v16u_buf =
-            (char *)malloc(frame.width * frame.height * sizeof(uint16_t));
-
-        float u_magnification = *((float *)p);
-        p += sizeof(float);
-        float u_bias = *((float *)p);
-        p += sizeof(float);
-        uint32_t u_comp_length = *((uint32_t *)p);
-        p += sizeof(uint32_t);
-        int u_decomp_length = frame.width * frame.height * sizeof(uint16_t);
-        decompress(p, u_comp_length, u16u_buf, &u_decomp_length);
-        p += u_comp_length;
-        LOG(INFO) << "u_comp_length = " << u_comp_length
-                  << ", u_decomp_length = " << u_decomp_length;
-
-        float v_magnification = *((float *)p);
-        p += sizeof(float);
-        float v_bias = *((float *)p);
-        p += sizeof(float);
-        uint32_t v_comp_length = *((uint32_t *)p);
-        p += sizeof(uint32_t);
-        int v_decomp_length = frame.width * frame.height * sizeof(uint16_t);
-        decompress(p, v_comp_length, v16u_buf, &v_decomp_length);
-        p += v_comp_length;
-        LOG(INFO) << "v_comp_length = " << v_comp_length
-                  << ", v_decomp_length = " << v_decomp_length;
-
-        cv::Mat u16u(frame.height, frame.width, CV_16SC1, u16u_buf);
-        cv::Mat v16u(frame.height, frame.width, CV_16SC1, v16u_buf);
-
-        cv::Mat u32f(frame.height, frame.width, CV_32FC1);
-        cv::Mat v32f(frame.height, frame.width, CV_32FC1);
-        cv::Mat uv_image(frame.height, frame.width, CV_32FC2);
-
-        u16u.convertTo(u32f, CV_32FC1, u_magnification, u_bias);
-        v16u.convertTo(v32f, CV_32FC1, v_magnification, v_bias);
-
-        cv::Mat in_uv[] = {u32f, v32f};
-        int from_to_uv[] = {0, 0, 1, 1};
-        mixChannels(in_uv, 2, &uv_image, 1, from_to_uv, 2);
-
-        std::shared_ptr<rs2::texture_coordinate> texture_coordinates_tmp(
-            new rs2::texture_coordinate[frame.n_points],
-            std::default_delete<rs2::texture_coordinate[]>());
-        frame.texture_coordinates = texture_coordinates_tmp;
-        memcpy(frame.texture_coordinates.get(), uv_image.data,
-               sizeof(rs2::texture_coordinate) * frame.n_points);
-    }
-
-    return frame;
+// Encodes the difference from the reference depth image divided by
+// temporal_step, or background_step outside the face region, and moves the
+// reference to what the receiver will decode, so that quantization errors do
+// not accumulate. A static scene gives a residual image of zeros.
+void encode_depth_residual(const camera::rs2_frame_data &frame,
+                           const Codec &codec, Predictor predictor,
+                           const Region &face, int background_step,
+                           SenderSession &session, SectionHeader &section,
+                           std::vector<uint8_t> &payload) {
+    const uint16_t *depth = frame.depth.get();
+    uint16_t *reference = session.reference_depth.data();
+    const int face_step = session.temporal_step;
+    thread_local std::vector<uint16_t> residual;
+    residual.resize(frame.n_points);
+    frame_format::for_each_depth_step(
+        face, frame.width, frame.height, face_step, background_step,
+        [&](uint32_t i, int step) {
+            int q;
+            if (step == 1) {
+                q = (int16_t)(depth[i] - reference[i]);
+            } else {
+                const int d = depth[i] - reference[i];
+                q = std::clamp((d >= 0 ? d + step / 2 : d - step / 2) / step,
+                               -32768, 32767);
+            }
+            residual[i] = predict::zigzag((uint16_t)q);
+            reference[i] = frame_format::apply_depth_residual(
+                reference[i], residual[i], step);
+        });
+
+    compress_image(codec, predictor, residual.data(), frame.width,
+                   frame.height, payload);
+    section = {SectionType::DEPTH_RESIDUAL, codec.id(), predictor,
+               Quantizer::LINEAR, (float)face_step, (float)background_step,
+               (uint32_t)payload.size()};
+    LOG(INFO) << "depth_residual: original size = "
+              << frame.n_points * sizeof(uint16_t)
+              << ", compressed size = " << payload.size() << " with "
+              << codec.spec() << ", " << predict::predictor_name(predictor);
+}
+
+// A frame which the sender is done with, or a new one while all of them are
+// in flight. Reusing the frames keeps their buffers.
+std::shared_ptr<SerializedFrame>
+recycle_serialized_frame(SenderSession &session) {
+    for (const auto &serialized : session.serialized_frames) {
+        // Only the session holds it, and only this thread hands it out.
+        if (serialized.use_count() == 1) {
+            // Pairs with the release by the sender.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return serialized;
+        }
+    }
+    session.serialized_frames.push_back(std::make_shared<SerializedFrame>());
+    return session.serialized_frames.back();
+}
+
+// Makes the codecs of the session, which restarts the streams.
+void make_codecs(SenderSession &session) {
+    for (const auto &[type, spec] : session.codec_specs) {
+        // A stream carries the history of one section type.
+        session.codecs[type] =
+            session.codec_streams
+                ? make_stream_codec(spec, session.codec_dictionary)
+                : make_codec(spec);
+    }
+}
+
+std::shared_ptr<SerializedFrame>
+serialize_frame_data(const camera::rs2_frame_data &frame, FrameMode mode,
+                     SenderSession &session, WorkerPool &pool) {
+    auto serialized = recycle_serialized_frame(session);
+    std::vector<std::vector<uint8_t>> &payloads = serialized->payloads;
+
+    // Frames from a dump or a webcam have no depth image.
+    if (mode == FrameMode::DEPTH && !frame.depth) {
+        mode = FrameMode::XYZ;
+    }
+    uint32_t flags = 0;
+    // Only frames from a RealSense camera have a calibration. The receiver
+    // needs u and v of the others.
+    const bool calibrated = (bool)frame.depth;
+    if (calibrated &&
+        (!session.calibration_sent || session.repeat_calibration)) {
+        flags |= FRAME_FLAG_CALIBRATION;
+    }
+    // Depth residuals and VP8 color refer to the previous frame. Both start
+    // over at a keyframe.
+    bool keyframe = session.keyframe_requested ||
+                    ++session.frames_since_keyframe >=
+                        session.keyframe_interval;
+    if (mode == FrameMode::DEPTH &&
+        session.reference_depth.size() != frame.n_points) {
+        keyframe = true;
+    }
+    if (session.color_codec == ColorCodec::VP8 &&
+        (!session.color_encoder ||
+         session.color_encoder->width() != (int)frame.width ||
+         session.color_encoder->height() != (int)frame.height)) {
+        session.color_encoder = std::make_unique<video_codec::Encoder>(
+            frame.width, frame.height, camera::FPS);
+        keyframe = true;
+    }
+    if (keyframe) {
+        session.frames_since_keyframe = 0;
+        session.keyframe_requested = false;
+        // The receiver may have missed frames which advanced the streams.
+        if (session.codec_streams) {
+            make_codecs(session);
+            flags |= FRAME_FLAG_STREAM_RESET;
+        }
+    }
+
+    // Without a face the whole frame is coded at full quality.
+    const Region face = session.face_roi
+                            ? face_region(frame.face, frame.width, frame.height)
+                            : Region{};
+    const bool has_face = !face.empty();
+    const Region depth_face =
+        mode == FrameMode::DEPTH ? depth_face_region(frame, face) : Region{};
+    const bool has_depth_face = !depth_face.empty();
+
+    cv::Mat xyz_image(frame.height, frame.width, CV_32FC3,
+                      frame.vertices.get());
+    cv::Mat uv_image(frame.height, frame.width, CV_32FC2,
+                     frame.texture_coordinates.get());
+
+    // The quantized channels need the valid points, so the mask is the first
+    // section and is computed before the others start.
+    std::vector<SectionHeader> &sections = session.sections;
+    std::vector<uint32_t> &valid = session.valid;
+    const size_t first = mode == FrameMode::XYZ ? 1 : 0;
+
+    // The other sections are independent. Each encoder writes only its own
+    // slot, so they run concurrently on the pool.
+    auto &encoders = session.encoders;
+    encoders.clear();
+    encoders.push_back([&](SectionHeader &section,
+                           std::vector<uint8_t> &payload) {
+        if (session.color_codec == ColorCodec::VP8) {
+            encode_rgb_video(frame, session.jpeg_quality, keyframe,
+                             *session.color_encoder, section, payload);
+        } else if (has_face) {
+            encode_rgb(frame,
+                       std::min(session.jpeg_quality,
+                                session.background_jpeg_quality),
+                       session.jpeg_subsampling, session.background_scale,
+                       section, payload);
+        } else {
+            encode_rgb(frame, session.jpeg_quality, session.jpeg_subsampling,
+                       1, section, payload);
+        }
+    });
+    if (has_face && session.color_codec == ColorCodec::JPEG) {
+        encoders.push_back([&](SectionHeader &section,
+                               std::vector<uint8_t> &payload) {
+            encode_rgb_face(frame, face, session.jpeg_quality,
+                            session.jpeg_subsampling, section, payload);
+        });
+    }
+    if (mode == FrameMode::XYZ) {
+        const SectionType types[] = {SectionType::X, SectionType::Y,
+                                     SectionType::Z};
+        for (int c = 0; c < 3; c++) {
+            ChannelQuantizer quantizer;
+            if (session.quantizer == QuantizerMode::STEP) {
+                quantizer.step = session.quantization_step;
+            } else {
+                quantizer.levels = (1 << session.quantization_bits) - 1;
+            }
+            if (session.quantizer == QuantizerMode::INVERSE &&
+                types[c] == SectionType::Z) {
+                quantizer.quantizer = Quantizer::INVERSE;
+            }
+            encoders.push_back([&, c, type = types[c], quantizer](
+                                   SectionHeader &section,
+                                   std::vector<uint8_t> &payload) {
+                encode_channel(xyz_image, c, valid, quantizer, type,
+                               *session.codecs.at(type), session.predictor,
+                               section, payload);
+            });
+        }
+    } else if (keyframe) {
+        encoders.push_back([&](SectionHeader &section,
+                               std::vector<uint8_t> &payload) {
+            encode_depth(frame, *session.codecs.at(SectionType::DEPTH),
+                         session.predictor, depth_face,
+                         has_depth_face ? session.background_depth_step : 1,
+                         session,
+                         section, payload);
+        });
+    } else {
+        encoders.push_back([&](SectionHeader &section,
+                               std::vector<uint8_t> &payload) {
+            encode_depth_residual(
+                frame, *session.codecs.at(SectionType::DEPTH_RESIDUAL),
+                session.predictor, depth_face,
+                has_depth_face ? std::max(session.temporal_step,
+                                    session.background_depth_step)
+                         : session.temporal_step,
+                session, section, payload);
+        });
+    }
+    if (!calibrated) {
+        encoders.push_back([&](SectionHeader &section,
+                               std::vector<uint8_t> &payload) {
+            encode_channel(uv_image, 0, valid,
+                           {Quantizer::LINEAR, (double)frame.width, 0.0},
+                           SectionType::U,
+                           *session.codecs.at(SectionType::U),
+                           session.predictor, section, payload);
+        });
+        encoders.push_back([&](SectionHeader &section,
+                               std::vector<uint8_t> &payload) {
+            encode_channel(uv_image, 1, valid,
+                           {Quantizer::LINEAR, (double)frame.height, 0.0},
+                           SectionType::V,
+                           *session.codecs.at(SectionType::V),
+                           session.predictor, section, payload);
+        });
+    }
+
+    // The payload vectors of a recycled frame keep their capacity.
+    sections.resize(first + encoders.size());
+    payloads.resize(first + encoders.size());
+    if (first > 0) {
+        encode_validity(frame, valid, sections[0], payloads[0]);
+    }
+    std::vector<std::future<void>> &pending = session.pending;
+    pending.clear();
+    for (size_t i = 0; i < encoders.size(); i++) {
+        pending.push_back(pool.submit([&, i] {
+            encoders[i](sections[first + i], payloads[first + i]);
+        }));
+    }
+    for (auto &p : pending) {
+        p.get();
+    }
+    // They refer to the locals of this call.
+    encoders.clear();
+
+    // The headers go last because they need the length of every payload.
+    size_t header_length =
+        sizeof(FrameHeader) + sizeof(SectionHeader) * sections.size();
+    if (flags & FRAME_FLAG_CALIBRATION) {
+        header_length += sizeof(Calibration);
+    }
+    serialized->header.resize(header_length);
+
+    FrameHeader frame_header;
+    frame_header.length = 0;
+    frame_header.height = frame.height;
+    frame_header.width = frame.width;
+    frame_header.n_points = frame.n_points;
+    frame_header.mode = mode;
+    frame_header.flags = flags;
+    frame_header.n_sections = sections.size();
+    frame_header.face = face;
+    frame_header.depth_face = depth_face;
+    frame_header.length = serialized->length();
+
+    uint8_t *p = serialized->header.data();
+    memcpy(p, &frame_header, sizeof(FrameHeader));
+    p += sizeof(FrameHeader);
+
+    if (flags & FRAME_FLAG_CALIBRATION) {
+        const Calibration calibration = {frame.depth_intrinsics,
+                                         frame.depth_scale,
+                                         frame.color_intrinsics,
+                                         frame.depth_to_color};
+        memcpy(p, &calibration, sizeof(Calibration));
+        p += sizeof(Calibration);
+        session.calibration_sent = true;
+    }
+
+    memcpy(p, sections.data(), sizeof(SectionHeader) * sections.size());
+
+    return serialized;
+}
+
+// A frame without sections which asks the peer for a keyframe.
+std::shared_ptr<SerializedFrame> serialize_keyframe_request() {
+    auto serialized = std::make_shared<SerializedFrame>();
+    FrameHeader frame_header = {};
+    frame_header.length = sizeof(FrameHeader);
+    // XYZ because the receiver checks depth frames against the calibration.
+    frame_header.mode = FrameMode::XYZ;
+    frame_header.flags = FRAME_FLAG_KEYFRAME_REQUEST;
+    serialized->header.resize(sizeof(FrameHeader));
+    memcpy(serialized->header.data(), &frame_header, sizeof(FrameHeader));
+    return serialized;
+}
+
+// What a receive pipeline asks of the send pipeline.
+enum class Control {
+    // The peer asked for a keyframe.
+    PEER_REQUESTED_KEYFRAME,
+    // Our decoder lost its reference, so ask the peer for a keyframe.
+    REQUEST_KEYFRAME,
+    // The connection to the peer is down.
+    PEER_LEFT,
+};
+
+struct ControlMessage {
+    Control control;
+    // The index of the peer.
+    size_t peer;
+};
+
+// Frames which may wait for a slow peer. More drop the waiting ones.
+const size_t SEND_QUEUE_CAPACITY = 2;
+
+// Hands the frame the parser has completed to the renderer, and the keyframe
+// requests of the peer to the send pipeline.
+void deliver_frame(
+    FrameParser &parser, size_t peer,
+    ThreadSafeQueue<camera::rs2_frame_data>::ThreadSafeQueuePushViewer
+        &frame_push,
+    ThreadSafeQueue<ControlMessage>::ThreadSafeQueuePushViewer
+        &control_push) {
+    if (parser.header().flags & FRAME_FLAG_KEYFRAME_REQUEST) {
+        LOG(INFO) << "Peer " << peer << " requested a keyframe";
+        control_push.push({Control::PEER_REQUESTED_KEYFRAME, peer});
+    }
+    if (parser.header().n_sections > 0) {
+        camera::rs2_frame_data frame = parser.take_frame();
+        frame.source = peer;
+        frame_push.push(frame);
+    } else {
+        parser.take_frame();
+    }
+}
+
+// Reads and decodes the frames of one peer on a thread of its own, so that
+// encoding and sending our frames does not delay them. It blocks in read
+// while nothing arrives, and the frame pool of the parser stops it while the
+// renderer is behind, which TCP passes on to the sender of the peer.
+void receive_main_loop(
+    ThreadSafeQueue<camera::rs2_frame_data>::ThreadSafeQueuePushViewer
+        &frame_push,
+    ThreadSafeQueue<ControlMessage>::ThreadSafeQueuePushViewer &control_push,
+    int socket, size_t peer, const ConnectorOptions &options) {
+
+    // Holds any frame in one piece, wherever it starts, so frames are
+    // decoded where they were read to.
+    MirroredRingBuffer buffer(frame_format::MAX_FRAME_LENGTH);
+    ReceiverSession receiver_session;
+    receiver_session.dictionary = options.codec_dictionary;
+    WorkerPool pool(options.codec_threads);
+    FrameParser parser(receiver_session, pool);
+
+    while (1) {
+        if (buffer.free_space() == 0) {
+            LOG(FATAL) << "A frame is longer than " << buffer.capacity()
+                       << " bytes";
+        }
+        int len_read =
+            read(socket, buffer.write_pointer(), buffer.free_space());
+        if (len_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len_read <= 0) {
+            control_push.push({Control::PEER_LEFT, peer});
+            break;
+        }
+        LOG(INFO) << "len_read = " << len_read;
+        buffer.commit(len_read);
+        // Decode the sections completed by this read. The buffer may
+        // already hold the beginning of the next frame.
+        while (parser.advance(buffer.data(), buffer.size())) {
+            const size_t frame_length = parser.frame_length();
+            deliver_frame(parser, peer, frame_push, control_push);
+            buffer.consume(frame_length);
+        }
+        if (receiver_session.keyframe_needed) {
+            control_push.push({Control::REQUEST_KEYFRAME, peer});
+            receiver_session.keyframe_needed = false;
+        }
+    }
+}
+
+// The receive pipeline of the UDP transport. Frames are decoded once all of
+// their packets are in, and a lost frame makes the frames referring to it
+// ask for a keyframe.
+void receive_datagrams_main_loop(
+    ThreadSafeQueue<camera::rs2_frame_data>::ThreadSafeQueuePushViewer
+        &frame_push,
+    ThreadSafeQueue<ControlMessage>::ThreadSafeQueuePushViewer &control_push,
+    int socket, size_t peer, const ConnectorOptions &options) {
+
+    ReceiverSession receiver_session;
+    WorkerPool pool(options.codec_threads);
+    FrameParser parser(receiver_session, pool);
+    DatagramReceiver receiver(
+        std::chrono::milliseconds(options.frame_deadline_ms));
+
+    // A frame arrives as a burst of packets.
+    int buffer_size = 8 * 1024 * 1024;
+    setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+               sizeof(buffer_size));
+    // Wake up to drop the frames past their deadline even when nothing
+    // arrives.
+    struct timeval timeout;
+    timeout.tv_sec = options.frame_deadline_ms / 1000;
+    timeout.tv_usec = options.frame_deadline_ms % 1000 * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::vector<uint8_t> packet(65536);
+    while (1) {
+        ssize_t len_read = recv(socket, packet.data(), packet.size(), 0);
+        const auto now = DatagramReceiver::Clock::now();
+        receiver.expire(now);
+        if (len_read < 0) {
+            // ECONNREFUSED reports that a packet we sent found nobody.
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                errno == ECONNREFUSED) {
+                continue;
+            }
+            LOG(ERROR) << "recv failed: " << strerror(errno);
+            control_push.push({Control::PEER_LEFT, peer});
+            break;
+        }
+        if (len_read == 0) {
+            // The socket was shut down. The peer never sends empty packets.
+            break;
+        }
+        if (!receiver.receive(packet.data(), len_read, now)) {
+            continue;
+        }
+        if (receiver.frames_lost() > 0) {
+            LOG(WARNING) << "Lost " << receiver.frames_lost() << " frames";
+            forget_references(receiver_session);
+        }
+        const std::vector<uint8_t> &frame = receiver.frame();
+        if (!parser.advance((const char *)frame.data(), frame.size()) ||
+            parser.frame_length() != frame.size()) {
+            LOG(FATAL) << "The length of a frame does not match its header";
+        }
+        deliver_frame(parser, peer, frame_push, control_push);
+        if (receiver_session.keyframe_needed) {
+            control_push.push({Control::REQUEST_KEYFRAME, peer});
+            receiver_session.keyframe_needed = false;
+        }
+    }
+}
+
+struct Peer {
+    explicit Peer(int socket_)
+        : socket(socket_), rate_controller(camera::FPS) {}
+
+    int socket;
+    bool connected = true;
+    std::unique_ptr<SendQueue> send_queue;
+    // Estimates the throughput to this peer alone.
+    RateController rate_controller;
+    std::thread receiver;
+};
+
+// The frames are encoded once for all peers, so the slowest one sets the
+// frame rate and the quality.
+RateController &bottleneck(std::vector<Peer> &peers,
+                           RateController &unconnected) {
+    RateController *slowest = nullptr;
+    for (Peer &peer : peers) {
+        if (!peer.connected) {
+            continue;
+        }
+        const RateTargets &targets = peer.rate_controller.targets();
+        if (!slowest ||
+            std::make_tuple(targets.fps, targets.jpeg_quality,
+                            targets.quantization_bits) <
+                std::make_tuple(slowest->targets().fps,
+                                slowest->targets().jpeg_quality,
+                                slowest->targets().quantization_bits)) {
+            slowest = &peer.rate_controller;
+        }
+    }
+    return slowest ? *slowest : unconnected;
 }
 
 int connector_main_loop(
@@ -387,76 +906,223 @@ int connector_main_loop(
         &frame_push,
     ThreadSafeQueue<camera::rs2_frame_data>::ThreadSafeQueuePopViewer
         &frame_pop,
-    int socket) {
-
-    const int BUF_LEN = 50000000;
-    char *rec_buf = (char *)malloc(BUF_LEN);
-    char *rec_buf2 = (char *)malloc(BUF_LEN);
-    char *snd_buf = (char *)malloc(BUF_LEN);
-    struct pollfd fd;
-    fd.fd = socket;
-    fd.events = POLLIN | POLLERR;
-    int n_accumlated_read = 0;
-    int send_frame_count = 0;
-
-    std::chrono::system_clock::time_point start, end;
+    std::vector<int> sockets, ConnectorOptions options) {
+
+    // Each peer has a receive pipeline and a send queue, each on a thread of
+    // its own. This thread encodes our frames once for all peers. Each
+    // pipeline has its own buffers and codec threads.
+    ThreadSafeQueue<ControlMessage> control;
+    auto control_push = control.getPushView();
+    auto control_pop = control.getPopView();
+    std::vector<Peer> peers;
+    peers.reserve(sockets.size());
+    for (int socket : sockets) {
+        peers.emplace_back(socket);
+        Peer &peer = peers.back();
+        std::unique_ptr<Sender> sender;
+        if (options.transport == Transport::UDP) {
+            sender = std::make_unique<DatagramSender>(
+                socket, options.fec_group, options.induced_loss);
+        } else {
+            sender = std::make_unique<FrameSender>(socket, options.zerocopy);
+        }
+        // Dropped frames would restart the codec streams at every keyframe
+        // the peer asks for, so a slow peer slows the encoder down instead.
+        peer.send_queue = std::make_unique<SendQueue>(
+            std::move(sender), SEND_QUEUE_CAPACITY, !options.codec_streams);
+    }
+    for (size_t i = 0; i < peers.size(); i++) {
+        peers[i].receiver = std::thread(
+            options.transport == Transport::UDP ? receive_datagrams_main_loop
+                                                : receive_main_loop,
+            std::ref(frame_push), std::ref(control_push), peers[i].socket, i,
+            std::cref(options));
+    }
+    // No sockets: debug mode.
+    size_t n_connected = peers.size();
 
-    while (1) {
-        poll(&fd, 1, 1);
-        if (fd.revents & POLLIN) {
-            int len_read = 0;
-            // If socket == -1 then debug mode.
-            if (socket != -1)
-                len_read = read(socket, rec_buf + n_accumlated_read, BUF_LEN);
-            if (len_read == 0) {
-                LOG(FATAL) << "Connection down";
+    int send_frame_count = 0;
+    SenderSession sender_session;
+    for (SectionType type : {SectionType::X, SectionType::Y, SectionType::Z,
+                             SectionType::DEPTH, SectionType::U,
+                             SectionType::V, SectionType::DEPTH_RESIDUAL}) {
+        auto it = options.section_codecs.find(type);
+        sender_session.codec_specs[type] =
+            it != options.section_codecs.end() ? it->second : options.codec;
+    }
+    sender_session.codec_streams = options.codec_streams;
+    sender_session.codec_dictionary = options.codec_dictionary;
+    make_codecs(sender_session);
+    sender_session.predictor = options.predictor;
+    sender_session.jpeg_subsampling = options.jpeg_subsampling;
+    sender_session.color_codec = options.color_codec;
+    sender_session.keyframe_interval = options.keyframe_interval;
+    sender_session.temporal_step = options.temporal_step;
+    sender_session.quantizer = options.quantizer;
+    if (options.quantization_bits > 0) {
+        sender_session.quantization_bits = options.quantization_bits;
+    }
+    sender_session.quantization_step = options.quantization_step;
+    sender_session.face_roi = options.face_roi;
+    sender_session.background_scale = options.background_scale;
+    sender_session.background_jpeg_quality = options.background_jpeg_quality;
+    sender_session.background_depth_step = options.background_depth_step;
+    // A peer may lose the frame with the calibration, over UDP or when its
+    // send queue drops it.
+    sender_session.repeat_calibration =
+        options.transport == Transport::UDP || peers.size() > 1;
+    WorkerPool pool(options.codec_threads);
+    // Paces the frames while no peer is connected.
+    RateController unconnected_rate_controller(camera::FPS);
+
+    // The thread sleeps until the camera pushes a frame or a receive
+    // pipeline needs something. The handlers only record what happened.
+    Reactor reactor;
+    bool frames_pushed = false;
+    bool control_pushed = false;
+    reactor.add(frame_pop.notification_fd(), Reactor::READABLE,
+                [&](uint32_t) { frames_pushed = true; });
+    reactor.add(control_pop.notification_fd(), Reactor::READABLE,
+                [&](uint32_t) { control_pushed = true; });
+    // Wake up to sample the sockets for the rate controllers even when
+    // nothing happens.
+    const int timeout_ms =
+        !peers.empty() ? (int)(RateController::SAMPLE_INTERVAL * 1000) : -1;
+
+    auto disconnect = [&](size_t i) {
+        Peer &peer = peers[i];
+        if (!peer.connected) {
+            return;
+        }
+        peer.connected = false;
+        // Wakes its send queue up from a blocked send.
+        shutdown(peer.socket, SHUT_RDWR);
+        if (--n_connected == 0) {
+            LOG(FATAL) << "Connection down";
+        } else {
+            LOG(WARNING) << "Peer " << i << " left";
+        }
+    };
+
+    while (peers.empty() || n_connected > 0) {
+        frames_pushed = false;
+        control_pushed = false;
+        reactor.run_once(timeout_ms);
+        const auto now = RateController::Clock::now();
+        for (size_t i = 0; i < peers.size(); i++) {
+            if (!peers[i].connected) {
+                continue;
+            }
+            if (!peers[i].send_queue->connected()) {
+                disconnect(i);
+                continue;
+            }
+            const SendQueue::SocketState state =
+                peers[i].send_queue->socket_state();
+            peers[i].rate_controller.on_socket_state(
+                state.bytes_written, state.queued_bytes, now);
+        }
+        if (control_pushed) {
+            control_pop.clear_notification();
+        }
+        while (!control_pop.empty()) {
+            const ControlMessage message = *control_pop.pop();
+            switch (message.control) {
+            case Control::PEER_REQUESTED_KEYFRAME:
+                sender_session.keyframe_requested = true;
+                break;
+            case Control::REQUEST_KEYFRAME:
+                peers[message.peer].send_queue->push_control(
+                    serialize_keyframe_request());
+                break;
+            case Control::PEER_LEFT:
+                disconnect(message.peer);
                 break;
             }
-            LOG(INFO) << "len_read = " << len_read;
-            n_accumlated_read += len_read;
-            if (n_accumlated_read > 4) {
-                int frame_length = *((uint32_t *)rec_buf);
-                LOG(INFO) << "frame_length = " << frame_length
-                          << ", n_accumlated_read = " << n_accumlated_read;
-                if (n_accumlated_read >= frame_length) {
-                    start = std::chrono::system_clock::now();
-
-                    auto f = deserialize_frame_data(rec_buf);
-                    frame_push.push(f);
-                    n_accumlated_read -= frame_length;
-                    memcpy(rec_buf2, rec_buf + frame_length, n_accumlated_read);
-                    std::swap(rec_buf, rec_buf2);
-
-                    end = std::chrono::system_clock::now();
-                    double time = static_cast<double>(
-                        std::chrono::duration_cast<std::chrono::microseconds>(
-                            end - start)
-                            .count() /
-                        1000.0);
-                    LOG(INFO)
-                        << "Frame decompression time = " << time << "[ms]";
-                }
+        }
+        if (frames_pushed) {
+            // Before emptying the queue, so that a frame pushed meanwhile
+            // wakes us up again.
+            frame_pop.clear_notification();
+        }
+        // Frames which arrived while the previous one was being encoded are
+        // stale, so only the newest is considered.
+        std::shared_ptr<camera::rs2_frame_data> f;
+        while (!frame_pop.empty()) {
+            if (f) {
+                send_frame_count++;
             }
+            f = frame_pop.pop();
         }
-        if (!frame_pop.empty()) {
-            auto f = frame_pop.pop();
-
-            if (send_frame_count % 5 == 0) {
-                size_t frame_data_length = serialize_frame_data(*f, snd_buf);
-                LOG(INFO) << "predicted bps = "
-                          << frame_data_length * camera::FPS * 8 / 1024.0 /
-                                 1024.0;
+        if (f) {
+            RateController &rate_controller =
+                bottleneck(peers, unconnected_rate_controller);
+            bool send_this;
+            if (options.send_interval > 0) {
+                send_this = send_frame_count % options.send_interval == 0;
+            } else {
+                send_this = rate_controller.should_send(now);
+                const RateTargets &targets = rate_controller.targets();
+                sender_session.jpeg_quality = targets.jpeg_quality;
+                if (options.quantization_bits == 0) {
+                    sender_session.quantization_bits =
+                        targets.quantization_bits;
+                }
+                sender_session.temporal_step =
+                    std::max(options.temporal_step, targets.depth_step);
+            }
 
-                if (socket != -1) {
-                    int len_send = send(socket, snd_buf, frame_data_length, 0);
-                    LOG(INFO) << "len_send = " << frame_data_length;
+            if (send_this) {
+                auto serialized = serialize_frame_data(
+                    *f, options.frame_mode, sender_session, pool);
+                // Reset by serialize_frame_data at every keyframe.
+                const bool keyframe = sender_session.frames_since_keyframe == 0;
+                size_t frame_data_length = serialized->length();
+                if (frame_data_length > frame_format::MAX_FRAME_LENGTH) {
+                    LOG(ERROR) << "Dropped a frame of " << frame_data_length
+                               << " bytes, which is too long for the peers";
+                    // Encoding it advanced the depth reference, the video
+                    // encoder and the codec streams past what the peers
+                    // have. The keyframe restarts all of them, and it
+                    // carries the calibration in case this frame did.
+                    sender_session.keyframe_requested = true;
+                    sender_session.calibration_sent = false;
+                    send_frame_count++;
+                    continue;
                 }
+                for (size_t i = 0; i < peers.size(); i++) {
+                    if (!peers[i].connected) {
+                        continue;
+                    }
+                    peers[i].rate_controller.on_sent(frame_data_length);
+                    if (!peers[i].send_queue->push(serialized, keyframe)) {
+                        LOG(WARNING) << "Dropped frames for peer " << i
+                                     << " until the next keyframe";
+                        // One of them may have carried the calibration.
+                        sender_session.keyframe_requested = true;
+                        sender_session.calibration_sent = false;
+                    }
+                }
+                unconnected_rate_controller.on_sent(frame_data_length);
+                const RateStats stats = rate_controller.stats();
+                LOG(INFO) << "Rate: throughput = "
+                          << stats.throughput * 8 / 1024.0 / 1024.0
+                          << " Mbps, frame = " << stats.frame_bytes
+                          << " bytes, queue delay = " << stats.queue_delay
+                          << " s, target fps = " << stats.targets.fps
+                          << ", jpeg quality = " << stats.targets.jpeg_quality
+                          << ", quantization bits = "
+                          << stats.targets.quantization_bits
+                          << ", depth step = " << stats.targets.depth_step;
             }
             send_frame_count++;
         }
     }
-    free(rec_buf);
-    free(rec_buf2);
-    free(snd_buf);
+    for (Peer &peer : peers) {
+        // Wakes the receive pipeline up from read.
+        shutdown(peer.socket, SHUT_RDWR);
+        peer.receiver.join();
+    }
+    return EXIT_FAILURE;
 }
 } // namespace connector
@@ -2,16 +2,99 @@
 
 #include <librealsense2/rs.hpp>
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include "camera.h"
 #include "eye_like.h"
+#include "frame_format.h"
+#include "jpeg_codec.h"
+#include "video_codec.h"
 #include "thread_safe_queue.h"
 
 namespace connector {
 
+using frame_format::FrameMode;
+using frame_format::SectionType;
+
+// How the color image is sent.
+// JPEG: every frame on its own.
+// VP8: a video stream which restarts at every keyframe.
+enum class ColorCodec { JPEG, VP8 };
+
+// How frames travel.
+// TCP: one stream, which delivers every frame in order however late.
+// UDP: datagrams with forward error correction. Frames which are lost or
+// late are dropped, and the frames after them do not wait.
+enum class Transport { TCP, UDP };
+
+// How x, y and z of XYZ frames are quantized to 16 bits.
+// RANGE: 2^bits - 1 steps over the range of the valid points of the frame.
+// STEP: a fixed step, so the error is at most half of it whatever the range.
+// INVERSE: as RANGE, but z is quantized as 1 / z.
+enum class QuantizerMode { RANGE, STEP, INVERSE };
+
+struct ConnectorOptions {
+    FrameMode frame_mode = FrameMode::DEPTH;
+    // The codec of the compressed sections as make_codec accepts it, and
+    // overrides for some section types.
+    std::string codec = "zlib:6";
+    std::map<SectionType, std::string> section_codecs;
+    // Compress each section type as one stream from keyframe to keyframe, so
+    // that a frame can refer to the previous ones. Applies to zlib and zstd.
+    bool codec_streams = false;
+    // Primes the streams at both ends. Both must use the same one.
+    std::string codec_dictionary;
+    // The spatial predictor of the 16-bit images.
+    predict::Predictor predictor = predict::Predictor::ADAPTIVE;
+    ColorCodec color_codec = ColorCodec::JPEG;
+    jpeg_codec::Subsampling jpeg_subsampling = jpeg_codec::Subsampling::S420;
+    QuantizerMode quantizer = QuantizerMode::RANGE;
+    // The bit depth of RANGE and INVERSE. 0 lets the rate controller choose it.
+    int quantization_bits = 0;
+    // The step of STEP in metres.
+    float quantization_step = 0.001f;
+    // Spend most of the bits on the face found by the eye tracker. The rest
+    // of the color image is sent background_scale times smaller and at most
+    // at background_jpeg_quality, and the rest of the depth image in steps of
+    // background_depth_step depth units.
+    bool face_roi = false;
+    int background_scale = 2;
+    int background_jpeg_quality = 50;
+    int background_depth_step = 4;
+    // Send every send_interval-th camera frame. 0 lets the rate controller
+    // choose the frame rate and the quality from the estimated throughput.
+    int send_interval = 0;
+    // Every keyframe_interval-th frame is a keyframe. Between keyframes, depth
+    // is sent as residuals and VP8 color as inter frames. 1 makes every frame
+    // a keyframe.
+    int keyframe_interval = 10;
+    // The quantization step of depth residuals in depth units. 1 is lossless.
+    int temporal_step = 1;
+    Transport transport = Transport::TCP;
+    // With UDP, a parity packet follows every fec_group data packets (0:
+    // none), a frame is dropped when it has not arrived frame_deadline_ms
+    // after its first packet, and each packet is dropped on purpose with the
+    // probability induced_loss.
+    int fec_group = 8;
+    int frame_deadline_ms = 100;
+    double induced_loss = 0.0;
+    // Send frames with MSG_ZEROCOPY. TCP only.
+    bool zerocopy = false;
+    // Threads which encode the sections of a frame concurrently, and as many
+    // which decode them. One per section of an XYZ frame. 0 runs them on the
+    // send and the receive pipeline threads.
+    int codec_threads = 6;
+};
+
+// Sends the camera frames to every peer and hands the frames of all of them
+// to the renderer, tagged with the index of their socket. Each frame is
+// serialized once for all peers. No sockets is debug mode.
 int connector_main_loop(
     ThreadSafeQueue<camera::rs2_frame_data>::ThreadSafeQueuePushViewer
         &frame_push,
     ThreadSafeQueue<camera::rs2_frame_data>::ThreadSafeQueuePopViewer
         &frame_pop,
-    int socket);
+    std::vector<int> sockets, ConnectorOptions options);
 } // namespace connector
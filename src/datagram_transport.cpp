@@ -0,0 +1,336 @@
+#include "datagram_transport.h"
+
+#include <glog/logging.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+namespace connector {
+
+namespace {
+
+const size_t PACKET_SIZE = sizeof(PacketHeader) + PACKET_PAYLOAD;
+// The data and parity packets of a frame. More do not fit in
+// PacketHeader::index.
+const size_t MAX_PACKETS = 0xffff;
+// Buffers kept for the next frames by the receiver.
+const size_t MAX_SPARE_BUFFERS = 4;
+
+size_t n_groups(size_t n_data, size_t fec_group) {
+    return fec_group > 0 ? (n_data + fec_group - 1) / fec_group : 0;
+}
+
+void xor_into(uint8_t *output, const uint8_t *input, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        output[i] ^= input[i];
+    }
+}
+
+bool wait_writable(int socket) {
+    struct pollfd fd;
+    fd.fd = socket;
+    fd.events = POLLOUT;
+    fd.revents = 0;
+    if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+        return false;
+    }
+    return !(fd.revents & (POLLHUP | POLLNVAL));
+}
+
+} // namespace
+
+DatagramSender::DatagramSender(int socket_, int fec_group_,
+                               double induced_loss_)
+    : socket(socket_), fec_group(fec_group_), induced_loss(induced_loss_),
+      random(std::random_device()()) {
+    if (socket < 0) {
+        return;
+    }
+    // A frame is sent as a burst of packets.
+    int buffer_size = 8 * 1024 * 1024;
+    setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &buffer_size,
+               sizeof(buffer_size));
+}
+
+bool DatagramSender::send(
+    std::shared_ptr<const frame_format::SerializedFrame> frame) {
+    const size_t frame_length = frame->length();
+    const size_t n_data =
+        std::max<size_t>(1, (frame_length + PACKET_PAYLOAD - 1) /
+                                PACKET_PAYLOAD);
+    const size_t n_parity = n_groups(n_data, fec_group);
+    const size_t n_packets = n_data + n_parity;
+    if (n_packets > MAX_PACKETS) {
+        LOG(ERROR) << "Dropped a frame of " << frame_length
+                   << " bytes, which is too long for datagrams";
+        return true;
+    }
+    const uint32_t frame_id = next_frame_id++;
+
+    flat.resize(frame_length);
+    uint8_t *p = flat.data();
+    memcpy(p, frame->header.data(), frame->header.size());
+    p += frame->header.size();
+    for (const auto &payload : frame->payloads) {
+        memcpy(p, payload.data(), payload.size());
+        p += payload.size();
+    }
+
+    packets.resize(n_packets * PACKET_SIZE);
+    iov.resize(n_packets);
+    // The parity packets XOR into zeros.
+    memset(packets.data() + n_data * PACKET_SIZE, 0, n_parity * PACKET_SIZE);
+    for (size_t i = 0; i < n_packets; i++) {
+        uint8_t *packet = packets.data() + i * PACKET_SIZE;
+        PacketHeader header = {};
+        header.frame_id = frame_id;
+        header.frame_length = frame_length;
+        header.index = i;
+        header.n_data = n_data;
+        header.fec_group = fec_group;
+        memcpy(packet, &header, sizeof(PacketHeader));
+
+        size_t length = PACKET_PAYLOAD;
+        if (i < n_data) {
+            const size_t offset = i * PACKET_PAYLOAD;
+            length = std::min(PACKET_PAYLOAD, frame_length - offset);
+            memcpy(packet + sizeof(PacketHeader), flat.data() + offset,
+                   length);
+            if (n_parity > 0) {
+                uint8_t *parity = packets.data() +
+                                  (n_data + i / fec_group) * PACKET_SIZE +
+                                  sizeof(PacketHeader);
+                xor_into(parity, flat.data() + offset, length);
+            }
+        }
+        iov[i] = {packet, sizeof(PacketHeader) + length};
+        total_written += sizeof(PacketHeader) + length;
+    }
+
+    if (induced_loss > 0.0) {
+        std::bernoulli_distribution drop(induced_loss);
+        iov.erase(std::remove_if(iov.begin(), iov.end(),
+                                 [&](const struct iovec &) {
+                                     return drop(random);
+                                 }),
+                  iov.end());
+    }
+    return send_packets(iov.size());
+}
+
+bool DatagramSender::send_packets(size_t n_packets) {
+#ifdef __linux__
+    messages.resize(n_packets);
+    for (size_t i = 0; i < n_packets; i++) {
+        memset(&messages[i], 0, sizeof(messages[i]));
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+    size_t first = 0;
+    while (first < n_packets) {
+#ifdef __linux__
+        int n_sent = sendmmsg(socket, &messages[first], n_packets - first, 0);
+#else
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[first];
+        msg.msg_iovlen = 1;
+        int n_sent = sendmsg(socket, &msg, 0) < 0 ? -1 : 1;
+#endif
+        if (n_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                if (!wait_writable(socket)) {
+                    return false;
+                }
+                continue;
+            }
+            if (errno == ECONNREFUSED) {
+                // The peer is not listening yet, or no more. The packet is
+                // lost like any other.
+                first++;
+                continue;
+            }
+            LOG(ERROR) << "sendmmsg failed: " << strerror(errno);
+            return false;
+        }
+        first += n_sent;
+    }
+    return true;
+}
+
+size_t DatagramSender::queued_bytes() const {
+    if (socket < 0) {
+        return 0;
+    }
+    int queued = 0;
+#if defined(SIOCOUTQ)
+    if (ioctl(socket, SIOCOUTQ, &queued) < 0) {
+        return 0;
+    }
+#endif
+    return queued;
+}
+
+DatagramReceiver::DatagramReceiver(Clock::duration deadline_)
+    : deadline(deadline_) {}
+
+bool DatagramReceiver::receive(const uint8_t *packet, size_t length,
+                               Clock::time_point now) {
+    if (length < sizeof(PacketHeader)) {
+        return false;
+    }
+    PacketHeader header;
+    memcpy(&header, packet, sizeof(PacketHeader));
+    const uint8_t *payload = packet + sizeof(PacketHeader);
+    const size_t payload_length = length - sizeof(PacketHeader);
+
+    const size_t n_data = header.n_data;
+    const size_t n_parity = n_groups(n_data, header.fec_group);
+    if (n_data == 0 ||
+        n_data != std::max<size_t>(1, (header.frame_length + PACKET_PAYLOAD -
+                                       1) / PACKET_PAYLOAD) ||
+        n_data + n_parity > MAX_PACKETS ||
+        header.index >= n_data + n_parity) {
+        LOG(WARNING) << "Dropped a malformed packet";
+        return false;
+    }
+    const size_t expected_length =
+        header.index < n_data
+            ? std::min(PACKET_PAYLOAD,
+                       header.frame_length - header.index * PACKET_PAYLOAD)
+            : PACKET_PAYLOAD;
+    if (payload_length != expected_length) {
+        LOG(WARNING) << "Dropped a malformed packet";
+        return false;
+    }
+    if (dropped_any &&
+        (int32_t)(header.frame_id - dropped_through) <= 0) {
+        // It or a later frame has been handed out or dropped.
+        return false;
+    }
+
+    auto [it, inserted] = assemblies.try_emplace(header.frame_id);
+    Assembly &assembly = it->second;
+    if (inserted) {
+        assembly.frame_length = header.frame_length;
+        assembly.n_data = header.n_data;
+        assembly.fec_group = header.fec_group;
+        if (!spare.empty()) {
+            assembly.data = std::move(spare.back());
+            spare.pop_back();
+        }
+        // The last data packet is padded with zeros for the parity.
+        assembly.data.assign((n_data + n_parity) * PACKET_PAYLOAD, 0);
+        assembly.have.assign(n_data + n_parity, 0);
+        assembly.first_arrival = now;
+    } else if (assembly.frame_length != header.frame_length ||
+               assembly.n_data != header.n_data ||
+               assembly.fec_group != header.fec_group) {
+        LOG(WARNING) << "Dropped a packet which does not match its frame";
+        return false;
+    }
+    if (assembly.have[header.index]) {
+        return false;
+    }
+    memcpy(assembly.data.data() + header.index * PACKET_PAYLOAD, payload,
+           payload_length);
+    assembly.have[header.index] = 1;
+    if (header.index < n_data) {
+        assembly.n_have_data++;
+    }
+    if (n_parity > 0) {
+        recover(assembly, header.index < n_data
+                              ? header.index / header.fec_group
+                              : header.index - n_data);
+    }
+    if (assembly.n_have_data < assembly.n_data) {
+        return false;
+    }
+
+    // The frames before this one can only be handed out of order now.
+    for (auto older = assemblies.begin(); older != it;) {
+        release(std::move(older->second.data));
+        older = assemblies.erase(older);
+    }
+    lost = has_delivered ? header.frame_id - last_delivered - 1
+                         : header.frame_id;
+    has_delivered = true;
+    last_delivered = header.frame_id;
+    drop_through(header.frame_id);
+    release(std::move(completed));
+    completed = std::move(assembly.data);
+    completed.resize(assembly.frame_length);
+    assemblies.erase(it);
+    return true;
+}
+
+void DatagramReceiver::recover(Assembly &assembly, size_t group) {
+    const size_t n_data = assembly.n_data;
+    if (!assembly.have[n_data + group]) {
+        return;
+    }
+    const size_t first = group * assembly.fec_group;
+    const size_t last = std::min(first + assembly.fec_group, n_data);
+    size_t missing = last;
+    for (size_t i = first; i < last; i++) {
+        if (!assembly.have[i]) {
+            if (missing != last) {
+                // Parity restores one packet only.
+                return;
+            }
+            missing = i;
+        }
+    }
+    if (missing == last) {
+        return;
+    }
+    uint8_t *data = assembly.data.data();
+    uint8_t *output = data + missing * PACKET_PAYLOAD;
+    memcpy(output, data + (n_data + group) * PACKET_PAYLOAD, PACKET_PAYLOAD);
+    for (size_t i = first; i < last; i++) {
+        if (i != missing) {
+            xor_into(output, data + i * PACKET_PAYLOAD, PACKET_PAYLOAD);
+        }
+    }
+    assembly.have[missing] = 1;
+    assembly.n_have_data++;
+}
+
+void DatagramReceiver::expire(Clock::time_point now) {
+    for (auto it = assemblies.begin(); it != assemblies.end();) {
+        if (now - it->second.first_arrival > deadline) {
+            drop_through(it->first);
+            release(std::move(it->second.data));
+            it = assemblies.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void DatagramReceiver::drop_through(uint32_t frame_id) {
+    if (!dropped_any || (int32_t)(frame_id - dropped_through) > 0) {
+        dropped_any = true;
+        dropped_through = frame_id;
+    }
+}
+
+void DatagramReceiver::release(std::vector<uint8_t> &&buffer) {
+    if (buffer.capacity() > 0 && spare.size() < MAX_SPARE_BUFFERS) {
+        spare.push_back(std::move(buffer));
+    }
+}
+
+} // namespace connector
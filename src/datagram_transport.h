@@ -0,0 +1,130 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "frame_format.h"
+#include "frame_sender.h"
+
+// A transport of serialized frames over a connected datagram socket, for
+// links where a late frame is worth nothing. Each frame is cut into packets
+// of PACKET_PAYLOAD bytes, and every fec_group data packets are followed by
+// a parity packet, their XOR, which restores any one of them that is lost.
+// The receiver hands out frames in order and drops the ones which miss their
+// deadline or are overtaken by a later frame, so a loss never stalls the
+// frames after it.
+//
+// Packet layout:
+//   PacketHeader
+//   Payload: bytes [index * PACKET_PAYLOAD, ...) of the frame, or the parity
+//            of FEC group index - n_data
+namespace connector {
+
+// The payload fits in the minimum IPv6 MTU with the IPv6, UDP and packet
+// headers.
+const size_t PACKET_PAYLOAD = 1200;
+
+struct PacketHeader {
+    uint32_t frame_id;
+    // Of the whole frame.
+    uint32_t frame_length;
+    // The data packets of a frame come first, then one parity packet per FEC
+    // group.
+    uint16_t index;
+    uint16_t n_data;
+    // Data packets per parity packet. 0 when there is no parity.
+    uint16_t fec_group;
+    uint16_t reserved;
+};
+
+class DatagramSender : public Sender {
+  public:
+    // induced_loss is the probability of dropping each packet instead of
+    // sending it, to try out loss over loopback.
+    DatagramSender(int socket, int fec_group, double induced_loss);
+
+    bool
+    send(std::shared_ptr<const frame_format::SerializedFrame> frame) override;
+
+    uint64_t bytes_written() const override { return total_written; }
+
+    size_t queued_bytes() const override;
+
+  private:
+    bool send_packets(size_t n_packets);
+
+    int socket;
+    int fec_group;
+    double induced_loss;
+    std::mt19937 random;
+    uint32_t next_frame_id = 0;
+    uint64_t total_written = 0;
+    // Reused by every send. The frame in one piece, and the packets with
+    // their headers.
+    std::vector<uint8_t> flat;
+    std::vector<uint8_t> packets;
+    std::vector<struct iovec> iov;
+#ifdef __linux__
+    std::vector<struct mmsghdr> messages;
+#endif
+};
+
+class DatagramReceiver {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // A frame is dropped when it is not complete deadline after its first
+    // packet arrived.
+    explicit DatagramReceiver(Clock::duration deadline);
+
+    // Takes one datagram. Returns true when it completed a frame, which is
+    // then in frame() until the next call.
+    bool receive(const uint8_t *packet, size_t length, Clock::time_point now);
+
+    const std::vector<uint8_t> &frame() const { return completed; }
+
+    // Frames which were dropped or never arrived right before frame().
+    uint32_t frames_lost() const { return lost; }
+
+    // Drops the incomplete frames which are past their deadline.
+    void expire(Clock::time_point now);
+
+  private:
+    struct Assembly {
+        uint32_t frame_length;
+        uint16_t n_data;
+        uint16_t fec_group;
+        // The data packets at their place in the frame, then the parity
+        // packets.
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> have;
+        uint32_t n_have_data = 0;
+        Clock::time_point first_arrival;
+    };
+
+    void recover(Assembly &assembly, size_t group);
+    void drop_through(uint32_t frame_id);
+    void release(std::vector<uint8_t> &&buffer);
+
+    Clock::duration deadline;
+    std::map<uint32_t, Assembly> assemblies;
+    bool has_delivered = false;
+    uint32_t last_delivered = 0;
+    // Packets of dropped_through and the frames before it are dropped,
+    // because a frame at least as late has been handed out or dropped.
+    bool dropped_any = false;
+    uint32_t dropped_through = 0;
+    std::vector<uint8_t> completed;
+    uint32_t lost = 0;
+    // Buffers of finished assemblies, reused by the next ones.
+    std::vector<std::vector<uint8_t>> spare;
+};
+
+} // namespace connector
@@ -212,6 +212,7 @@ void detectAndDisplay(cv::Mat frame) {
         rectangle(debugImage, faces[i], 1234);
     }
     //-- Show what you got
+    face_rect = faces.size() > 0 ? faces[0] : cv::Rect();
     if (faces.size() > 0) {
         findEyes(frame_gray, faces[0]);
     }
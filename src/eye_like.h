@@ -12,6 +12,8 @@ inline double left_eye_center_x = 0;
 inline double left_eye_center_y = 0;
 inline double right_eye_center_x = 0;
 inline double right_eye_center_y = 0;
+// The face found by the last detectAndDisplay. Empty when there was none.
+inline cv::Rect face_rect;
 
 struct EyesPosition {
     double left_eye_center_x;
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <librealsense2/rs.hpp>
+
+#include "compress.h"
+#include "predict.h"
+
+// The layout of a serialized frame on the wire.
+//
+//   FrameHeader
+//   Calibration                         (only with FRAME_FLAG_CALIBRATION)
+//   SectionHeader x n_sections
+//   payload of section 0, payload of section 1, ...
+//
+// All the metadata comes first so that the sender can hand the payloads to
+// the kernel as they are and the receiver knows where every section ends as
+// soon as the headers have arrived.
+namespace frame_format {
+
+// How the geometry of a frame is put on the wire.
+// XYZ: x, y and z of every vertex as three quantized images.
+// DEPTH: the native Z16 depth image. The receiver deprojects it with the depth
+// intrinsics of the Calibration. Between keyframes the image is
+// sent as the residual against the previous reconstructed depth image.
+enum class FrameMode : uint32_t { XYZ = 0, DEPTH = 1 };
+
+// The frame carries the Calibration of the camera.
+const uint32_t FRAME_FLAG_CALIBRATION = 1 << 0;
+// The peer asks for a keyframe because it cannot decode depth residuals or
+// video color. A frame with only this flag has no sections.
+const uint32_t FRAME_FLAG_KEYFRAME_REQUEST = 1 << 1;
+// A keyframe which restarts the codec streams, so that it decodes without
+// the frames before it.
+const uint32_t FRAME_FLAG_STREAM_RESET = 1 << 2;
+
+enum class SectionType : uint32_t {
+    // The color image, downscaled by the factor in magnification. When the
+    // frame has a face region, RGB_FACE_JPEG replaces that part of it.
+    RGB_JPEG = 0,
+    X = 1,
+    Y = 2,
+    Z = 3,
+    // Samples inside the face region are quantized with the step in
+    // magnification and the others with the step in bias.
+    DEPTH = 4,
+    U = 5,
+    V = 6,
+    // Zigzag-encoded differences from the previous depth image, quantized
+    // with the steps of DEPTH.
+    DEPTH_RESIDUAL = 7,
+    // The run-length-coded mask of the points with z != 0. The quantized
+    // channels hold the valid points only. It precedes them in the table.
+    VALIDITY = 8,
+    // The color image as one VP8 frame, which may refer to the previous one.
+    RGB_VP8 = 9,
+    // The face region of the color image at full resolution.
+    RGB_FACE_JPEG = 10,
+};
+
+inline const char *section_name(SectionType type) {
+    switch (type) {
+    case SectionType::RGB_JPEG:
+        return "rgb";
+    case SectionType::X:
+        return "x";
+    case SectionType::Y:
+        return "y";
+    case SectionType::Z:
+        return "z";
+    case SectionType::DEPTH:
+        return "depth";
+    case SectionType::U:
+        return "u";
+    case SectionType::V:
+        return "v";
+    case SectionType::DEPTH_RESIDUAL:
+        return "depth_residual";
+    case SectionType::VALIDITY:
+        return "validity";
+    case SectionType::RGB_VP8:
+        return "rgb_vp8";
+    case SectionType::RGB_FACE_JPEG:
+        return "rgb_face";
+    }
+    return "unknown";
+}
+
+// The inverse of section_name. Returns false for an unknown name.
+inline bool section_type_from_name(const std::string &name,
+                                   SectionType &type) {
+    const SectionType types[] = {
+        SectionType::RGB_JPEG, SectionType::X, SectionType::Y,
+        SectionType::Z,        SectionType::DEPTH, SectionType::U,
+        SectionType::V,        SectionType::DEPTH_RESIDUAL,
+        SectionType::VALIDITY, SectionType::RGB_VP8,
+        SectionType::RGB_FACE_JPEG};
+    for (SectionType t : types) {
+        if (name == section_name(t)) {
+            type = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The depth which a DEPTH_RESIDUAL sample stands for. With a step of 1 the
+// residual is the exact difference modulo 2^16.
+inline uint16_t apply_depth_residual(uint16_t reference, uint16_t residual,
+                                     int step) {
+    const int16_t q = (int16_t)predict::unzigzag(residual);
+    if (step == 1) {
+        return (uint16_t)(reference + q);
+    }
+    return (uint16_t)std::clamp(reference + q * step, 0, 0xffff);
+}
+
+// What a RealSense camera needs to turn a depth image into vertices and map
+// vertices onto the color image. It does not change during a session, so it
+// is sent with the first frame only, and the receiver computes the texture
+// coordinates of every frame from it instead of receiving u and v.
+struct Calibration {
+    rs2_intrinsics depth_intrinsics;
+    float depth_scale;
+    rs2_intrinsics color_intrinsics;
+    rs2_extrinsics depth_to_color;
+};
+
+// A rectangle of the color or the depth image in pixels. The depth camera of
+// a D4xx sees about 87x58 degrees and the color camera about 69x42 degrees
+// from beside it, so the same object lies at different pixels in the two.
+struct Region {
+    uint32_t x, y, width, height;
+
+    bool empty() const { return width == 0 || height == 0; }
+};
+
+// The longest frame a receiver accepts. It sizes the receive buffer, so the
+// sender drops longer frames.
+const uint32_t MAX_FRAME_LENGTH = 48 * 1024 * 1024;
+
+struct FrameHeader {
+    // The length of the whole frame including this header.
+    uint32_t length;
+    uint32_t height, width, n_points;
+    FrameMode mode;
+    uint32_t flags;
+    uint32_t n_sections;
+    // Where the face is in the color image and in the depth image. The
+    // sender spends most of the bits there. Empty when it has found none.
+    Region face;
+    Region depth_face;
+};
+
+// Calls f(i, step) for every sample i of a width x height depth image, with
+// face_step inside the face region and background_step outside it.
+template <class F>
+void for_each_depth_step(const Region &face, uint32_t width, uint32_t height,
+                         int face_step, int background_step, F f) {
+    for (uint32_t y = 0; y < height; y++) {
+        const bool face_row = y >= face.y && y - face.y < face.height;
+        const uint32_t begin = face_row ? std::min(face.x, width) : width;
+        const uint32_t end =
+            face_row ? std::min(face.x + face.width, width) : width;
+        const uint32_t row = y * width;
+        for (uint32_t x = 0; x < begin; x++) {
+            f(row + x, background_step);
+        }
+        for (uint32_t x = begin; x < end; x++) {
+            f(row + x, face_step);
+        }
+        for (uint32_t x = end; x < width; x++) {
+            f(row + x, background_step);
+        }
+    }
+}
+
+// How a quantized sample q of a float channel maps back to its value.
+// LINEAR: q * magnification + bias.
+// INVERSE: 1 / (q * magnification + bias). Quantizing 1 / z gives near points
+// finer steps than far ones, like the depth error of the camera itself.
+enum class Quantizer : uint32_t { LINEAR = 0, INVERSE = 1 };
+
+struct SectionHeader {
+    SectionType type;
+    // How the payload is compressed.
+    CodecId codec;
+    // How the 16-bit samples were predicted before compression.
+    predict::Predictor predictor;
+    Quantizer quantizer;
+    // The parameters of the quantizer. Quantization ranges cover the valid
+    // points only.
+    float magnification;
+    float bias;
+    uint32_t length;
+};
+
+struct SerializedFrame {
+    // FrameHeader, the calibration and the section table.
+    std::vector<uint8_t> header;
+    // Payloads in the order of the section table.
+    std::vector<std::vector<uint8_t>> payloads;
+
+    size_t length() const {
+        size_t l = header.size();
+        for (const auto &p : payloads) {
+            l += p.size();
+        }
+        return l;
+    }
+};
+
+} // namespace frame_format
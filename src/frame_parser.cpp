@@ -0,0 +1,594 @@
+#include "frame_parser.h"
+
+#include "compress.h"
+#include "jpeg_codec.h"
+#include "rle.h"
+
+#include <librealsense2/rsutil.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace connector {
+
+using frame_format::Calibration;
+using frame_format::FRAME_FLAG_CALIBRATION;
+using frame_format::FRAME_FLAG_STREAM_RESET;
+using frame_format::FrameHeader;
+using frame_format::FrameMode;
+using frame_format::Quantizer;
+using frame_format::Region;
+using frame_format::section_name;
+using frame_format::SectionHeader;
+using frame_format::SectionType;
+
+namespace {
+void set_calibration(ReceiverSession &session,
+                     const Calibration &calibration) {
+    session.has_calibration = true;
+    session.calibration = calibration;
+    const rs2_intrinsics &intrinsics = calibration.depth_intrinsics;
+    session.rays.resize(2 * intrinsics.width * intrinsics.height);
+    for (int y = 0; y < intrinsics.height; y++) {
+        for (int x = 0; x < intrinsics.width; x++) {
+            const float pixel[2] = {(float)x, (float)y};
+            float point[3];
+            rs2_deproject_pixel_to_point(point, &intrinsics, pixel, 1.0f);
+            const int i = y * intrinsics.width + x;
+            session.rays[2 * i] = point[0];
+            session.rays[2 * i + 1] = point[1];
+        }
+    }
+    LOG(INFO) << "Depth intrinsics: " << intrinsics.width << "x"
+              << intrinsics.height
+              << ", depth_scale = " << calibration.depth_scale
+              << ", color intrinsics: " << calibration.color_intrinsics.width
+              << "x" << calibration.color_intrinsics.height;
+}
+
+void deproject_depth(const ReceiverSession &session, const uint16_t *depth,
+                     uint32_t n_points, rs2::vertex *vertices) {
+    for (uint32_t i = 0; i < n_points; i++) {
+        const float z = depth[i] * session.calibration.depth_scale;
+        vertices[i].x = session.rays[2 * i] * z;
+        vertices[i].y = session.rays[2 * i + 1] * z;
+        vertices[i].z = z;
+    }
+}
+
+// What rs2::pointcloud::map_to computes: the position of each vertex in the
+// color image, normalized to [0, 1].
+void map_to_color(const Calibration &calibration, const rs2::vertex *vertices,
+                  size_t n_points,
+                  rs2::texture_coordinate *texture_coordinates) {
+    const rs2_intrinsics &color = calibration.color_intrinsics;
+    for (size_t i = 0; i < n_points; i++) {
+        if (vertices[i].z <= 0.0f) {
+            texture_coordinates[i] = {0.0f, 0.0f};
+            continue;
+        }
+        float point[3];
+        float pixel[2];
+        rs2_transform_point_to_point(point, &calibration.depth_to_color,
+                                     &vertices[i].x);
+        rs2_project_point_to_pixel(pixel, &color, point);
+        texture_coordinates[i] = {pixel[0] / color.width,
+                                  pixel[1] / color.height};
+    }
+}
+
+// Decompresses a payload with the codec it is tagged with. output_length is
+// the expected length.
+void decompress_payload(const SectionHeader &section, const char *payload,
+                        const ReceiverSession &session, char *output,
+                        int &output_length) {
+    const Codec *codec = codec_for_id(section.codec);
+    if (!codec) {
+        // begin_frame has made the streams of the frame.
+        auto it = session.streams.find(section.type);
+        if (it != session.streams.end() && it->second->id() == section.codec) {
+            codec = it->second.get();
+        }
+    }
+    if (!codec) {
+        LOG(FATAL) << section_name(section.type) << " uses codec "
+                   << (uint32_t)section.codec
+                   << ", which is not compiled into this binary";
+    }
+    const int expected_length = output_length;
+    if (codec->decompress(payload, section.length, output, &output_length) !=
+            0 ||
+        output_length != expected_length) {
+        LOG(FATAL) << "Failed to decompress " << section_name(section.type)
+                   << " with " << codec->spec();
+    }
+}
+
+// The inverse of compress_image. Decodes width * height samples into image.
+void decompress_image(const SectionHeader &section, const char *payload,
+                      const ReceiverSession &session, int width, int height,
+                      uint16_t *image) {
+    if (section.predictor == predict::Predictor::NONE) {
+        int length = width * height * sizeof(uint16_t);
+        decompress_payload(section, payload, session, (char *)image, length);
+        return;
+    }
+    // Sections decode on the pool, so each thread has its own.
+    thread_local std::vector<uint16_t> filtered;
+    filtered.resize(predict::filtered_length(section.predictor, width, height));
+    int length = filtered.size() * sizeof(uint16_t);
+    decompress_payload(section, payload, session, (char *)filtered.data(),
+                       length);
+    if (!predict::unfilter(section.predictor, filtered.data(), width, height,
+                           image)) {
+        LOG(FATAL) << "Broken prediction residuals in "
+                   << section_name(section.type);
+    }
+}
+
+// The inverse of encode_channel. Writes the channel of the valid points into
+// `image` in place.
+void decode_channel(const SectionHeader &section, const char *payload,
+                    const ReceiverSession &session,
+                    const std::vector<uint32_t> &valid, cv::Mat &image,
+                    int channel) {
+    const int n_valid = valid.size();
+    thread_local std::vector<uint16_t> quantized;
+    thread_local std::vector<float> values;
+    quantized.resize(n_valid);
+    values.resize(n_valid);
+    cv::Mat c16u(1, n_valid, CV_16UC1, quantized.data());
+    int decomp_length = n_valid * sizeof(uint16_t);
+    if (section.predictor == predict::Predictor::NONE) {
+        decompress_payload(section, payload, session, (char *)quantized.data(),
+                           decomp_length);
+    } else {
+        // Predicted on the grid of the image. See encode_channel.
+        thread_local std::vector<uint16_t> filtered;
+        thread_local std::vector<uint16_t> grid;
+        filtered.resize(predict::filtered_sparse_length(section.predictor,
+                                                        n_valid, image.rows));
+        grid.resize((size_t)image.rows * image.cols);
+        int length = filtered.size() * sizeof(uint16_t);
+        decompress_payload(section, payload, session, (char *)filtered.data(),
+                           length);
+        if (!predict::unfilter_sparse(section.predictor, filtered.data(),
+                                      image.cols, image.rows, valid.data(),
+                                      n_valid, grid.data())) {
+            LOG(FATAL) << "Broken prediction residuals in "
+                       << section_name(section.type);
+        }
+        for (int i = 0; i < n_valid; i++) {
+            quantized[i] = grid[valid[i]];
+        }
+    }
+    LOG(INFO) << section_name(section.type)
+              << "_comp_length = " << section.length << ", "
+              << section_name(section.type)
+              << "_decomp_length = " << decomp_length;
+
+    cv::Mat c32f(1, n_valid, CV_32FC1, values.data());
+    c16u.convertTo(c32f, CV_32FC1, section.magnification, section.bias);
+    float *gathered = values.data();
+    if (section.quantizer == Quantizer::INVERSE) {
+        for (int i = 0; i < n_valid; i++) {
+            gathered[i] = 1.0f / gathered[i];
+        }
+    }
+    float *samples = (float *)image.data;
+    const int n_channels = image.channels();
+    for (int i = 0; i < n_valid; i++) {
+        samples[(size_t)valid[i] * n_channels + channel] = gathered[i];
+    }
+}
+
+// The inverse of encode_rgb. The face region is left to RGB_FACE_JPEG, which
+// may be decoding concurrently.
+void decode_rgb(const SectionHeader &section, const char *payload,
+                const Region &face, camera::rs2_frame_data &frame) {
+    const int scale = std::max(1, (int)section.magnification);
+    cv::Mat image(frame.height, frame.width, CV_8UC3, frame.rgb.get());
+    if (scale == 1 && face.empty()) {
+        if (!jpeg_codec::decode((const uint8_t *)payload, section.length,
+                                image.data, frame.width, frame.height)) {
+            LOG(FATAL) << "Failed to decode the color image";
+        }
+        return;
+    }
+    const int width = (frame.width + scale - 1) / scale;
+    const int height = (frame.height + scale - 1) / scale;
+    // create keeps the buffers while the frame size does not change.
+    thread_local cv::Mat small, full;
+    small.create(height, width, CV_8UC3);
+    if (!jpeg_codec::decode((const uint8_t *)payload, section.length,
+                            small.data, width, height)) {
+        LOG(FATAL) << "Failed to decode the color image";
+    }
+    if (face.empty()) {
+        cv::resize(small, image, image.size(), 0, 0, cv::INTER_LINEAR);
+        return;
+    }
+    const cv::Mat *background = &small;
+    if (scale > 1) {
+        cv::resize(small, full, image.size(), 0, 0, cv::INTER_LINEAR);
+        background = &full;
+    }
+    const size_t row_length = 3 * frame.width;
+    const size_t face_begin = 3 * face.x;
+    const size_t face_end = 3 * (face.x + face.width);
+    for (uint32_t y = 0; y < frame.height; y++) {
+        uint8_t *dst = frame.rgb.get() + y * row_length;
+        const uint8_t *src = background->data + y * row_length;
+        if (y < face.y || y - face.y >= face.height) {
+            memcpy(dst, src, row_length);
+        } else {
+            memcpy(dst, src, face_begin);
+            memcpy(dst + face_end, src + face_end, row_length - face_end);
+        }
+    }
+}
+
+// Writes the face region of the color image.
+void decode_rgb_face(const SectionHeader &section, const char *payload,
+                     const Region &face, camera::rs2_frame_data &frame) {
+    thread_local cv::Mat roi;
+    roi.create(face.height, face.width, CV_8UC3);
+    if (!jpeg_codec::decode((const uint8_t *)payload, section.length,
+                            roi.data, face.width, face.height)) {
+        LOG(FATAL) << "Failed to decode the face image";
+    }
+    const size_t row_length = 3 * frame.width;
+    for (uint32_t y = 0; y < face.height; y++) {
+        memcpy(frame.rgb.get() + (face.y + y) * row_length + 3 * face.x,
+               roi.data + y * 3 * face.width, 3 * face.width);
+    }
+}
+
+// The inverse of the quantization of the background in encode_depth.
+void dequantize_depth(const SectionHeader &section, const Region &face,
+                      camera::rs2_frame_data &frame) {
+    const int background_step = std::max(1, (int)section.bias);
+    if (background_step == 1) {
+        return;
+    }
+    uint16_t *depth = frame.depth.get();
+    frame_format::for_each_depth_step(
+        face, frame.width, frame.height, 1, background_step,
+        [&](uint32_t i, int step) {
+            depth[i] = (uint16_t)std::min(depth[i] * step, 0xffff);
+        });
+}
+
+// The inverse of encode_depth_residual.
+void decode_depth_residual(const SectionHeader &section, const char *payload,
+                           const Region &face, camera::rs2_frame_data &frame,
+                           ReceiverSession &session) {
+    uint16_t *depth = frame.depth.get();
+    if (session.reference_depth.size() != frame.n_points) {
+        LOG(WARNING) << "Received a depth residual without its keyframe";
+        memset(depth, 0, frame.n_points * sizeof(uint16_t));
+        session.keyframe_needed = true;
+        return;
+    }
+    decompress_image(section, payload, session, frame.width, frame.height,
+                     depth);
+    const int face_step = (int)section.magnification;
+    const int background_step = std::max(face_step, (int)section.bias);
+    uint16_t *reference = session.reference_depth.data();
+    frame_format::for_each_depth_step(
+        face, frame.width, frame.height, face_step, background_step,
+        [&](uint32_t i, int step) {
+            depth[i] = frame_format::apply_depth_residual(reference[i],
+                                                          depth[i], step);
+            reference[i] = depth[i];
+        });
+    LOG(INFO) << "depth_residual_comp_length = " << section.length;
+}
+
+// face is the face region of the color image and depth_face that of the depth
+// image.
+void decode_section(const SectionHeader &section, const char *payload,
+                    const std::vector<uint32_t> &valid, const Region &face,
+                    const Region &depth_face, camera::rs2_frame_data &frame,
+                    ReceiverSession &session) {
+    switch (section.type) {
+    case SectionType::RGB_JPEG:
+        decode_rgb(section, payload, face, frame);
+        break;
+    case SectionType::RGB_FACE_JPEG:
+        decode_rgb_face(section, payload, face, frame);
+        break;
+    case SectionType::RGB_VP8:
+        if (!session.color_decoder) {
+            if (!video_codec::available()) {
+                LOG(FATAL) << "Received VP8 color, but libvpx is not "
+                              "compiled into this binary";
+            }
+            session.color_decoder = std::make_unique<video_codec::Decoder>();
+        }
+        if (!session.color_decoder->decode((const uint8_t *)payload,
+                                           section.length, frame.rgb.get(),
+                                           frame.width, frame.height)) {
+            LOG(WARNING) << "Cannot decode the color image until a keyframe";
+            memset(frame.rgb.get(), 0, 3 * frame.width * frame.height);
+            session.keyframe_needed = true;
+        }
+        break;
+    case SectionType::X:
+    case SectionType::Y:
+    case SectionType::Z: {
+        cv::Mat xyz_image(frame.height, frame.width, CV_32FC3,
+                          frame.vertices.get());
+        decode_channel(section, payload, session, valid, xyz_image,
+                       (int)section.type - (int)SectionType::X);
+        break;
+    }
+    case SectionType::DEPTH: {
+        int depth_decomp_length = frame.n_points * sizeof(uint16_t);
+        decompress_image(section, payload, session, frame.width,
+                         frame.height, frame.depth.get());
+        dequantize_depth(section, depth_face, frame);
+        LOG(INFO) << "depth_comp_length = " << section.length
+                  << ", depth_decomp_length = " << depth_decomp_length;
+        session.reference_depth.assign(frame.depth.get(),
+                                       frame.depth.get() + frame.n_points);
+        deproject_depth(session, frame.depth.get(), frame.n_points,
+                        frame.vertices.get());
+        break;
+    }
+    case SectionType::DEPTH_RESIDUAL:
+        decode_depth_residual(section, payload, depth_face, frame, session);
+        deproject_depth(session, frame.depth.get(), frame.n_points,
+                        frame.vertices.get());
+        break;
+    case SectionType::U:
+    case SectionType::V: {
+        cv::Mat uv_image(frame.height, frame.width, CV_32FC2,
+                         frame.texture_coordinates.get());
+        decode_channel(section, payload, session, valid, uv_image,
+                       (int)section.type - (int)SectionType::U);
+        break;
+    }
+    default:
+        LOG(FATAL) << "Unknown section type: " << (uint32_t)section.type;
+    }
+}
+} // namespace
+
+void forget_references(ReceiverSession &session) {
+    session.reference_depth.clear();
+    // A new decoder rejects inter frames.
+    session.color_decoder.reset();
+    session.keyframe_needed = true;
+}
+
+FrameParser::FrameParser(ReceiverSession &session_, WorkerPool &pool_)
+    : session(session_), pool(pool_), frame_pool(FRAME_POOL_CAPACITY) {}
+
+void FrameParser::begin_frame(const char *buf) {
+    const char *p = buf + sizeof(FrameHeader);
+
+    frame = camera::rs2_frame_data();
+    frame.height = frame_header.height;
+    frame.width = frame_header.width;
+    frame.n_points = frame_header.n_points;
+    const Region &face = frame_header.face;
+    for (const Region &region : {face, frame_header.depth_face}) {
+        if (!region.empty() && (region.x + region.width > frame.width ||
+                                region.y + region.height > frame.height)) {
+            LOG(FATAL) << "The face region is outside the frame";
+        }
+    }
+    frame.face = cv::Rect(face.x, face.y, face.width, face.height);
+
+    if (frame_header.flags & FRAME_FLAG_CALIBRATION) {
+        Calibration calibration;
+        memcpy(&calibration, p, sizeof(Calibration));
+        p += sizeof(Calibration);
+        set_calibration(session, calibration);
+    }
+
+    sections.resize(frame_header.n_sections);
+    memcpy(sections.data(), p, sizeof(SectionHeader) * sections.size());
+    // Nothing decodes before the sections are known to fill the frame
+    // exactly. Otherwise they would run into the bytes after it.
+    uint32_t remaining = frame_header.length - header_length;
+    for (const SectionHeader &section : sections) {
+        if (section.length > remaining) {
+            LOG(FATAL) << "The sections run past the frame length of "
+                       << frame_header.length;
+        }
+        remaining -= section.length;
+    }
+    if (remaining != 0) {
+        LOG(FATAL) << "The sections end " << remaining
+                   << " bytes before the frame length of "
+                   << frame_header.length;
+    }
+    // A stream lives until a keyframe restarts it. Each is made here, before
+    // the sections decode concurrently.
+    if (frame_header.flags & FRAME_FLAG_STREAM_RESET) {
+        session.streams.clear();
+    }
+    for (const SectionHeader &section : sections) {
+        if (codec_for_id(section.codec)) {
+            continue;
+        }
+        auto &stream = session.streams[section.type];
+        if (!stream || stream->id() != section.codec) {
+            stream = make_stream_decoder(section.codec, session.dictionary);
+        }
+        if (!stream) {
+            session.streams.erase(section.type);
+        }
+    }
+    valid.clear();
+    needs_texture_coordinates =
+        !sections.empty() &&
+        std::none_of(sections.begin(), sections.end(),
+                     [](const SectionHeader &section) {
+                         return section.type == SectionType::U;
+                     });
+    if (needs_texture_coordinates && !session.has_calibration) {
+        LOG(FATAL) << "Received a frame without texture coordinates before "
+                      "the calibration";
+    }
+    next_section = 0;
+    section_offset = header_length;
+
+    // Sections decode directly into these buffers.
+    const bool depth = frame_header.mode == FrameMode::DEPTH;
+    if (!frame_pool.acquire(frame, frame.width, frame.height, frame.n_points,
+                            depth)) {
+        // The renderer is behind. Waiting stops the receive pipeline from
+        // reading, so the peer sees its send queue grow and slows down.
+        LOG(WARNING) << "All " << FRAME_POOL_CAPACITY
+                     << " frame buffers are in use";
+        frame_pool.acquire_wait(frame, frame.width, frame.height,
+                                frame.n_points, depth);
+    }
+
+    if (depth) {
+        const rs2_intrinsics &intrinsics =
+            session.calibration.depth_intrinsics;
+        if (!session.has_calibration) {
+            LOG(FATAL) << "Received a depth frame before the calibration";
+        }
+        if (frame.n_points !=
+            (uint32_t)(intrinsics.width * intrinsics.height)) {
+            LOG(FATAL) << "The depth image does not match the intrinsics: "
+                       << frame.n_points << " points";
+        }
+        frame.depth_intrinsics = intrinsics;
+        frame.depth_scale = session.calibration.depth_scale;
+    }
+}
+
+bool FrameParser::advance(const char *buf, size_t n_available) {
+    std::chrono::system_clock::time_point start =
+        std::chrono::system_clock::now();
+
+    if (state == State::FRAME_HEADER) {
+        if (n_available < sizeof(FrameHeader)) {
+            return false;
+        }
+        memcpy(&frame_header, buf, sizeof(FrameHeader));
+        header_length = sizeof(FrameHeader) +
+                        sizeof(SectionHeader) * frame_header.n_sections;
+        if (frame_header.flags & FRAME_FLAG_CALIBRATION) {
+            header_length += sizeof(Calibration);
+        }
+        if (frame_header.length < header_length) {
+            LOG(FATAL) << "Broken frame header: length = "
+                       << frame_header.length
+                       << ", header_length = " << header_length;
+        }
+        decode_time = 0.0;
+        state = State::SECTION_TABLE;
+    }
+
+    if (state == State::SECTION_TABLE) {
+        if (n_available < header_length) {
+            return false;
+        }
+        begin_frame(buf);
+        state = State::SECTIONS;
+    }
+
+    if (state == State::SECTIONS) {
+        while (next_section < sections.size() &&
+               section_offset + sections[next_section].length <= n_available) {
+            const SectionHeader &section = sections[next_section];
+            const char *payload = buf + section_offset;
+            if (section.type == SectionType::VALIDITY) {
+                // The channels after it depend on it, and it is small.
+                decode_validity(section, payload);
+            } else {
+                pending.push_back(pool.submit([this, &section, payload] {
+                    decode_section(section, payload, valid, frame_header.face,
+                                   frame_header.depth_face, frame, session);
+                }));
+            }
+            section_offset += section.length;
+            next_section++;
+        }
+        if (next_section == sections.size()) {
+            for (auto &p : pending) {
+                p.get();
+            }
+            pending.clear();
+            if (needs_texture_coordinates) {
+                map_texture_coordinates();
+            }
+        }
+
+        std::chrono::system_clock::time_point end =
+            std::chrono::system_clock::now();
+        double time = static_cast<double>(
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+                .count() /
+            1000.0);
+        decode_time += time;
+
+        if (next_section < sections.size()) {
+            return false;
+        }
+        // Only the last call has to wait for the last byte.
+        LOG(INFO) << "Frame decompression time = " << decode_time
+                  << "[ms] in the parser, " << time
+                  << "[ms] after the last byte";
+        state = State::DONE;
+    }
+
+    return state == State::DONE;
+}
+
+// Points outside the mask are zero.
+void FrameParser::decode_validity(const SectionHeader &section,
+                                  const char *payload) {
+    mask.resize(frame.n_points);
+    if (!rle::decode_mask((const uint8_t *)payload, section.length,
+                          mask.data(), mask.size())) {
+        LOG(FATAL) << "Broken validity mask";
+    }
+    valid.clear();
+    for (uint32_t i = 0; i < frame.n_points; i++) {
+        if (mask[i]) {
+            valid.push_back(i);
+        }
+    }
+    memset(frame.vertices.get(), 0, sizeof(rs2::vertex) * frame.n_points);
+    memset(frame.texture_coordinates.get(), 0,
+           sizeof(rs2::texture_coordinate) * frame.n_points);
+    LOG(INFO) << "validity: valid points = " << valid.size() << " of "
+              << frame.n_points;
+}
+
+// Needs all the vertices, so it runs after the other sections. Split into
+// ranges of points for the pool.
+void FrameParser::map_texture_coordinates() {
+    const size_t N_RANGES = 8;
+    const size_t range_length = (frame.n_points + N_RANGES - 1) / N_RANGES;
+    for (size_t begin = 0; begin < frame.n_points; begin += range_length) {
+        const size_t n = std::min<size_t>(range_length, frame.n_points - begin);
+        pending.push_back(pool.submit([this, begin, n] {
+            map_to_color(session.calibration, frame.vertices.get() + begin, n,
+                         frame.texture_coordinates.get() + begin);
+        }));
+    }
+    for (auto &p : pending) {
+        p.get();
+    }
+    pending.clear();
+}
+
+camera::rs2_frame_data FrameParser::take_frame() {
+    state = State::FRAME_HEADER;
+    sections.clear();
+    return std::move(frame);
+}
+
+} // namespace connector
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <librealsense2/rs.hpp>
+
+#include "camera.h"
+#include "frame_format.h"
+#include "frame_pool.h"
+#include "video_codec.h"
+#include "worker_pool.h"
+
+namespace connector {
+
+struct ReceiverSession {
+    bool has_calibration = false;
+    frame_format::Calibration calibration;
+    // x and y of each depth pixel deprojected at z = 1, interleaved. The
+    // deprojection is linear in depth, so a vertex is just ray * z.
+    std::vector<float> rays;
+    // The last decoded depth image, which depth residuals refer to.
+    std::vector<uint16_t> reference_depth;
+    // The decoders of stream-coded sections by section type, created by the
+    // first section of each, and the dictionary which primes them.
+    std::map<frame_format::SectionType, std::shared_ptr<Codec>> streams;
+    std::string dictionary;
+    // Created by the first VP8 color section.
+    std::unique_ptr<video_codec::Decoder> color_decoder;
+    // A depth residual or a VP8 frame arrived without its reference. Set from
+    // the pool and cleared by the caller once it has asked the peer for a
+    // keyframe.
+    std::atomic<bool> keyframe_needed = false;
+};
+
+// After a frame was lost, the frames which refer to it cannot be decoded.
+// Forgets the references, so that those frames ask for a keyframe instead of
+// decoding against the wrong one.
+void forget_references(ReceiverSession &session);
+
+// Decodes one frame from the receive buffer while it is still arriving. Every
+// call hands the sections which have become complete since the previous call
+// to the pool, so most of the decoding is done by the time the last byte
+// arrives. Each section decodes into its own part of the frame buffers.
+class FrameParser {
+  public:
+    FrameParser(ReceiverSession &session, WorkerPool &pool);
+
+    // buf holds the first n_available bytes of the current frame. The bytes
+    // already given must not change between calls. Returns true when the
+    // frame is complete.
+    bool advance(const char *buf, size_t n_available);
+
+    // Valid after advance returned true.
+    uint32_t frame_length() const { return frame_header.length; }
+    const frame_format::FrameHeader &header() const { return frame_header; }
+
+    // Hands over the completed frame and gets ready for the next one.
+    camera::rs2_frame_data take_frame();
+
+  private:
+    // Decoded frames in flight between the parser and the renderer. When all
+    // of them are in use, the parser waits for one.
+    static const size_t FRAME_POOL_CAPACITY = 4;
+
+    enum class State { FRAME_HEADER, SECTION_TABLE, SECTIONS, DONE };
+
+    void begin_frame(const char *buf);
+    void decode_validity(const frame_format::SectionHeader &section,
+                         const char *payload);
+    void map_texture_coordinates();
+
+    ReceiverSession &session;
+    WorkerPool &pool;
+    State state = State::FRAME_HEADER;
+    frame_format::FrameHeader frame_header;
+    size_t header_length = 0;
+    std::vector<frame_format::SectionHeader> sections;
+    // Indices of the points with z != 0 from the validity section.
+    std::vector<uint32_t> valid;
+    std::vector<uint8_t> mask;
+    // The frame has no u and v, so they are computed from the calibration.
+    bool needs_texture_coordinates = false;
+    size_t next_section = 0;
+    size_t section_offset = 0;
+    std::vector<std::future<void>> pending;
+    camera::FramePool frame_pool;
+    camera::rs2_frame_data frame;
+    double decode_time = 0.0;
+};
+
+} // namespace connector
@@ -0,0 +1,79 @@
+#include "frame_pool.h"
+
+namespace camera {
+
+FramePool::FramePool(size_t capacity) : shared(std::make_shared<Slots>()) {
+    shared->capacity = capacity;
+    shared->slots.reserve(capacity);
+}
+
+FramePool::Slot *FramePool::take_free() {
+    for (const auto &slot : shared->slots) {
+        if (!slot->in_use) {
+            slot->in_use = true;
+            return slot.get();
+        }
+    }
+    if (shared->slots.size() == shared->capacity) {
+        return nullptr;
+    }
+    shared->slots.push_back(std::make_unique<Slot>());
+    shared->slots.back()->in_use = true;
+    return shared->slots.back().get();
+}
+
+bool FramePool::acquire(rs2_frame_data &frame, uint32_t width,
+                        uint32_t height, uint32_t n_points, bool depth) {
+    Slot *slot;
+    {
+        std::lock_guard<std::mutex> lock(shared->m);
+        slot = take_free();
+    }
+    if (!slot) {
+        return false;
+    }
+    attach(slot, frame, width, height, n_points, depth);
+    return true;
+}
+
+void FramePool::acquire_wait(rs2_frame_data &frame, uint32_t width,
+                             uint32_t height, uint32_t n_points, bool depth) {
+    Slot *slot;
+    {
+        std::unique_lock<std::mutex> lock(shared->m);
+        shared->released.wait(lock,
+                              [&] { return (slot = take_free()) != nullptr; });
+    }
+    attach(slot, frame, width, height, n_points, depth);
+}
+
+void FramePool::attach(Slot *slot, rs2_frame_data &frame, uint32_t width,
+                       uint32_t height, uint32_t n_points, bool depth) {
+    // The vectors keep their capacity, so this allocates only when the frame
+    // size grows.
+    slot->rgb.resize((size_t)3 * width * height);
+    slot->vertices.resize(n_points);
+    slot->texture_coordinates.resize(n_points);
+    // The last buffer of the frame to go hands the slot back. The mutex also
+    // orders the writes of its users before those of its next one.
+    std::shared_ptr<Slot> lease(slot, [shared = shared](Slot *slot) {
+        {
+            std::lock_guard<std::mutex> lock(shared->m);
+            slot->in_use = false;
+        }
+        shared->released.notify_one();
+    });
+    frame.rgb = std::shared_ptr<uint8_t>(lease, slot->rgb.data());
+    frame.vertices =
+        std::shared_ptr<rs2::vertex>(lease, slot->vertices.data());
+    frame.texture_coordinates = std::shared_ptr<rs2::texture_coordinate>(
+        lease, slot->texture_coordinates.data());
+    if (depth) {
+        slot->depth.resize(n_points);
+        frame.depth = std::shared_ptr<uint16_t>(lease, slot->depth.data());
+    } else {
+        frame.depth.reset();
+    }
+}
+
+} // namespace camera
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <librealsense2/rs.hpp>
+
+#include "camera.h"
+
+namespace camera {
+
+// A fixed number of frame buffers which are handed out again once no
+// rs2_frame_data refers to them, so a steady stream of frames allocates
+// nothing. The buffers of a frame alias one shared slot, so handing them out
+// does not allocate either, apart from the small shared_ptr control block of
+// each frame. The frames may be released on any thread, and outlive the pool.
+class FramePool {
+  public:
+    explicit FramePool(size_t capacity);
+
+    // Points the buffers of frame at a free slot sized for width x height
+    // color pixels and n_points points. The depth image is set only with
+    // depth. Returns false when every slot is in use.
+    bool acquire(rs2_frame_data &frame, uint32_t width, uint32_t height,
+                 uint32_t n_points, bool depth);
+
+    // As acquire, but waits for a frame to be released when every slot is in
+    // use.
+    void acquire_wait(rs2_frame_data &frame, uint32_t width, uint32_t height,
+                      uint32_t n_points, bool depth);
+
+  private:
+    struct Slot {
+        std::vector<uint8_t> rgb;
+        std::vector<rs2::vertex> vertices;
+        std::vector<rs2::texture_coordinate> texture_coordinates;
+        std::vector<uint16_t> depth;
+        bool in_use = false;
+    };
+
+    // Shared with the frames, which hand their slot back when released.
+    struct Slots {
+        std::mutex m;
+        std::condition_variable released;
+        size_t capacity;
+        std::vector<std::unique_ptr<Slot>> slots;
+    };
+
+    // A free slot, marked in use, or nullptr. Called with the lock held.
+    Slot *take_free();
+    void attach(Slot *slot, rs2_frame_data &frame, uint32_t width,
+                uint32_t height, uint32_t n_points, bool depth);
+
+    std::shared_ptr<Slots> shared;
+};
+
+} // namespace camera
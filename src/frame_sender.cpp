@@ -0,0 +1,194 @@
+#include "frame_sender.h"
+
+#include <glog/logging.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_MSG_ZEROCOPY
+#endif
+
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace connector {
+
+FrameSender::FrameSender(int socket_, bool zerocopy_) : socket(socket_) {
+    if (!zerocopy_ || socket < 0) {
+        return;
+    }
+#ifdef HAVE_MSG_ZEROCOPY
+    int one = 1;
+    if (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+        zerocopy = true;
+    } else {
+        LOG(WARNING) << "SO_ZEROCOPY failed: " << strerror(errno)
+                     << ". Fall back to copying sends.";
+    }
+#else
+    LOG(WARNING) << "MSG_ZEROCOPY is not supported on this platform.";
+#endif
+}
+
+bool FrameSender::wait_writable() {
+    struct pollfd fd;
+    fd.fd = socket;
+    fd.events = POLLOUT;
+    fd.revents = 0;
+    if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+        return false;
+    }
+    return !(fd.revents & (POLLHUP | POLLNVAL));
+}
+
+bool FrameSender::send(
+    std::shared_ptr<const frame_format::SerializedFrame> frame) {
+    iov.clear();
+    iov.push_back({(void *)frame->header.data(), frame->header.size()});
+    for (const auto &payload : frame->payloads) {
+        if (!payload.empty()) {
+            iov.push_back({(void *)payload.data(), payload.size()});
+        }
+    }
+
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+    if (zerocopy) {
+        flags |= MSG_ZEROCOPY;
+    }
+#endif
+
+    size_t first = 0;
+    while (first < iov.size()) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[first];
+        msg.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+
+        ssize_t len_send = sendmsg(socket, &msg, flags);
+        if (len_send < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                // ENOBUFS means too many zerocopy sends are not completed.
+                reap_completions();
+                if (!wait_writable()) {
+                    return false;
+                }
+                continue;
+            }
+            LOG(ERROR) << "sendmsg failed: " << strerror(errno);
+            return false;
+        }
+        if (zerocopy && len_send > 0) {
+            next_zerocopy_id++;
+        }
+        total_written += len_send;
+
+        // Skip what has been written and resume from the middle of the
+        // iovec where the kernel stopped.
+        size_t written = len_send;
+        while (first < iov.size() && written >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            first++;
+        }
+        if (written > 0) {
+            iov[first].iov_base = (char *)iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+
+    if (zerocopy) {
+        in_flight.emplace_back(next_zerocopy_id - 1, std::move(frame));
+    }
+    return true;
+}
+
+size_t FrameSender::queued_bytes() const {
+    if (socket < 0) {
+        return 0;
+    }
+    int queued = 0;
+#if defined(SIOCOUTQ)
+    if (ioctl(socket, SIOCOUTQ, &queued) < 0) {
+        return 0;
+    }
+#elif defined(SO_NWRITE)
+    socklen_t len = sizeof(queued);
+    if (getsockopt(socket, SOL_SOCKET, SO_NWRITE, &queued, &len) < 0) {
+        return 0;
+    }
+#endif
+    return queued;
+}
+
+void FrameSender::reap_completions() {
+#ifdef HAVE_MSG_ZEROCOPY
+    if (!zerocopy) {
+        return;
+    }
+
+    bool completed = false;
+    uint32_t completed_id = 0;
+    while (true) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 &&
+                  cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            auto *err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                continue;
+            }
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                LOG_FIRST_N(INFO, 1)
+                    << "The kernel copied a MSG_ZEROCOPY send. Zerocopy does "
+                       "not pay off on this route.";
+            }
+            // [ee_info, ee_data] is the range of completed sendmsg calls.
+            if (!completed || (int32_t)(err->ee_data - completed_id) > 0) {
+                completed_id = err->ee_data;
+            }
+            completed = true;
+        }
+    }
+
+    while (completed && !in_flight.empty() &&
+           (int32_t)(in_flight.front().first - completed_id) <= 0) {
+        in_flight.pop_front();
+    }
+#endif
+}
+
+} // namespace connector
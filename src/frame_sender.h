@@ -0,0 +1,72 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "frame_format.h"
+
+namespace connector {
+
+// Hands serialized frames to a transport.
+class Sender {
+  public:
+    virtual ~Sender() = default;
+
+    // Blocks until the whole frame is queued in the kernel. Returns false
+    // when the connection is broken.
+    virtual bool
+    send(std::shared_ptr<const frame_format::SerializedFrame> frame) = 0;
+
+    // Call it when poll reports POLLERR on the socket.
+    virtual void reap_completions() {}
+
+    // Bytes handed to the kernel so far.
+    virtual uint64_t bytes_written() const = 0;
+
+    // Bytes written but not yet sent or acknowledged by the peer, or 0 when
+    // the platform cannot tell.
+    virtual size_t queued_bytes() const = 0;
+};
+
+// Writes serialized frames to a stream socket. The header and the payloads
+// are handed to the kernel as an iovec array, so a frame is never copied into
+// a contiguous buffer.
+class FrameSender : public Sender {
+  public:
+    // With zerocopy, the kernel reads the payloads directly from our memory
+    // (MSG_ZEROCOPY). It falls back to ordinary sends when the platform or the
+    // socket does not support it.
+    FrameSender(int socket, bool zerocopy);
+
+    // Retries partial writes.
+    bool
+    send(std::shared_ptr<const frame_format::SerializedFrame> frame) override;
+
+    // Releases the frames the kernel has finished reading from.
+    void reap_completions() override;
+
+    uint64_t bytes_written() const override { return total_written; }
+
+    size_t queued_bytes() const override;
+
+  private:
+    bool wait_writable();
+
+    int socket;
+    bool zerocopy = false;
+    uint64_t total_written = 0;
+    // Reused by every send.
+    std::vector<struct iovec> iov;
+    // The kernel numbers zerocopy sendmsg calls from 0.
+    uint32_t next_zerocopy_id = 0;
+    // Frames the kernel may still read from, with the id of their last
+    // sendmsg call.
+    std::deque<std::pair<uint32_t,
+                         std::shared_ptr<const frame_format::SerializedFrame>>>
+        in_flight;
+};
+
+} // namespace connector
@@ -0,0 +1,158 @@
+#include "jpeg_codec.h"
+
+#include <glog/logging.h>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#else
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+// IMWRITE_JPEG_SAMPLING_FACTOR came with OpenCV 4.5.5.
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR > 5) || \
+    (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR == 5 && \
+     CV_VERSION_REVISION >= 5)
+#define HAVE_CV_JPEG_SAMPLING_FACTOR
+#endif
+#endif
+
+#include <memory>
+
+namespace jpeg_codec {
+
+namespace {
+
+const struct {
+    Subsampling subsampling;
+    const char *name;
+} subsampling_names[] = {
+    {Subsampling::S444, "444"},
+    {Subsampling::S422, "422"},
+    {Subsampling::S420, "420"},
+};
+
+#ifdef HAVE_TURBOJPEG
+using Handle = std::unique_ptr<void, int (*)(tjhandle)>;
+
+int tj_subsampling(Subsampling subsampling) {
+    switch (subsampling) {
+    case Subsampling::S444:
+        return TJSAMP_444;
+    case Subsampling::S422:
+        return TJSAMP_422;
+    default:
+        return TJSAMP_420;
+    }
+}
+#endif
+
+#ifdef HAVE_CV_JPEG_SAMPLING_FACTOR
+int cv_sampling_factor(Subsampling subsampling) {
+    switch (subsampling) {
+    case Subsampling::S444:
+        return cv::IMWRITE_JPEG_SAMPLING_FACTOR_444;
+    case Subsampling::S422:
+        return cv::IMWRITE_JPEG_SAMPLING_FACTOR_422;
+    default:
+        return cv::IMWRITE_JPEG_SAMPLING_FACTOR_420;
+    }
+}
+#endif
+
+} // namespace
+
+bool subsampling_from_name(const std::string &name, Subsampling &subsampling) {
+    for (const auto &s : subsampling_names) {
+        if (name == s.name) {
+            subsampling = s.subsampling;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *subsampling_name(Subsampling subsampling) {
+    for (const auto &s : subsampling_names) {
+        if (subsampling == s.subsampling) {
+            return s.name;
+        }
+    }
+    return "unknown";
+}
+
+bool subsampling_available(Subsampling subsampling) {
+#if defined(HAVE_TURBOJPEG) || defined(HAVE_CV_JPEG_SAMPLING_FACTOR)
+    return true;
+#else
+    return subsampling == Subsampling::S420;
+#endif
+}
+
+#ifdef HAVE_TURBOJPEG
+
+bool encode(const uint8_t *bgr, int width, int height, int quality,
+            Subsampling subsampling, std::vector<uint8_t> &jpeg) {
+    // Handles are expensive to create, so each thread keeps one.
+    thread_local Handle handle(tjInitCompress(), tjDestroy);
+    const int tj_subsamp = tj_subsampling(subsampling);
+    jpeg.resize(tjBufSize(width, height, tj_subsamp));
+    unsigned char *output = jpeg.data();
+    unsigned long length = jpeg.size();
+    if (tjCompress2(handle.get(), bgr, width, 0, height, TJPF_BGR, &output,
+                    &length, tj_subsamp, quality, TJFLAG_NOREALLOC) != 0) {
+        LOG(ERROR) << "tjCompress2 failed: " << tjGetErrorStr2(handle.get());
+        return false;
+    }
+    jpeg.resize(length);
+    return true;
+}
+
+bool decode(const uint8_t *jpeg, size_t length, uint8_t *bgr, int width,
+            int height) {
+    thread_local Handle handle(tjInitDecompress(), tjDestroy);
+    int jpeg_width, jpeg_height, jpeg_subsamp, jpeg_colorspace;
+    if (tjDecompressHeader3(handle.get(), jpeg, length, &jpeg_width,
+                            &jpeg_height, &jpeg_subsamp,
+                            &jpeg_colorspace) != 0 ||
+        jpeg_width != width || jpeg_height != height) {
+        LOG(ERROR) << "Unexpected JPEG image: " << jpeg_width << "x"
+                   << jpeg_height;
+        return false;
+    }
+    if (tjDecompress2(handle.get(), jpeg, length, bgr, width, 0, height,
+                      TJPF_BGR, 0) != 0) {
+        LOG(ERROR) << "tjDecompress2 failed: " << tjGetErrorStr2(handle.get());
+        return false;
+    }
+    return true;
+}
+
+#else
+
+bool encode(const uint8_t *bgr, int width, int height, int quality,
+            Subsampling subsampling, std::vector<uint8_t> &jpeg) {
+    cv::Mat image(height, width, CV_8UC3, (void *)bgr);
+#ifdef HAVE_CV_JPEG_SAMPLING_FACTOR
+    return cv::imencode(".jpg", image, jpeg,
+                        {cv::IMWRITE_JPEG_QUALITY, quality,
+                         cv::IMWRITE_JPEG_SAMPLING_FACTOR,
+                         cv_sampling_factor(subsampling)});
+#else
+    (void)subsampling;
+    return cv::imencode(".jpg", image, jpeg,
+                        {cv::IMWRITE_JPEG_QUALITY, quality});
+#endif
+}
+
+bool decode(const uint8_t *jpeg, size_t length, uint8_t *bgr, int width,
+            int height) {
+    const cv::Mat input(1, length, CV_8UC1, (void *)jpeg);
+    // imdecode writes into dst when the size and the type already match.
+    cv::Mat image(height, width, CV_8UC3, bgr);
+    cv::imdecode(input, cv::IMREAD_COLOR, &image);
+    return image.data == bgr && image.rows == height && image.cols == width;
+}
+
+#endif
+
+} // namespace jpeg_codec
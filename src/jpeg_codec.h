@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// JPEG coding of BGR color images. With libjpeg-turbo every thread keeps its
+// TurboJPEG handles across frames, compresses into the output vector without
+// another buffer and decompresses straight into the destination image.
+// Without it, OpenCV is used, which chooses the subsampling since 4.5.5 and
+// always subsamples 4:2:0 before.
+namespace jpeg_codec {
+
+enum class Subsampling { S444, S422, S420 };
+
+// The inverse of subsampling_name. Returns false for an unknown name.
+bool subsampling_from_name(const std::string &name, Subsampling &subsampling);
+const char *subsampling_name(Subsampling subsampling);
+
+// Whether encode can produce the subsampling.
+bool subsampling_available(Subsampling subsampling);
+
+// Both return false on failure.
+bool encode(const uint8_t *bgr, int width, int height, int quality,
+            Subsampling subsampling, std::vector<uint8_t> &jpeg);
+
+// bgr must hold width * height pixels, which must match the JPEG image.
+bool decode(const uint8_t *jpeg, size_t length, uint8_t *bgr, int width,
+            int height);
+
+} // namespace jpeg_codec
@@ -7,18 +7,25 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <thread>
+#include <vector>
 
+#include <boost/program_options.hpp>
 #include <glog/logging.h>
 
 #include "camera.h"
+#include "compress.h"
 #include "connector.h"
 #include "renderer.h"
 
 #define PORT 8080
 
-int setup_client() {
+// With datagram, the socket is a UDP socket connected to the server.
+int setup_client(bool datagram) {
     int sock = 0, valread, rc;
     struct in6_addr serv_addr;
     struct addrinfo hints, *res = NULL;
@@ -28,7 +35,7 @@ int setup_client() {
     memset(&hints, 0x00, sizeof(hints));
     hints.ai_flags = AI_NUMERICSERV;
     hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = datagram ? SOCK_DGRAM : SOCK_STREAM;
 
     std::string server_address;
     std::cout << "Server address: ";
@@ -71,7 +78,10 @@ int setup_client() {
     return sock;
 }
 
-int setup_server() {
+// Returns a socket for each of the n_peers clients, in the order they
+// connected. With datagram, there is one client, and its socket is a UDP
+// socket connected to it.
+std::vector<int> setup_server(bool datagram, int n_peers) {
     int server_fd, new_socket, valread;
     struct sockaddr_in6 address;
     int opt = 1;
@@ -83,7 +93,8 @@ int setup_server() {
     memset(&fd, 0, sizeof(fd));
 
     // Creating socket file descriptor
-    if ((server_fd = socket(AF_INET6, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET6, datagram ? SOCK_DGRAM : SOCK_STREAM,
+                            0)) == 0) {
         perror("socket failed");
         exit(EXIT_FAILURE);
     }
@@ -103,42 +114,405 @@ int setup_server() {
         perror("bind failed");
         exit(EXIT_FAILURE);
     }
-    if (listen(server_fd, 3) < 0) {
+    if (datagram) {
+        valread = recvfrom(server_fd, buffer, sizeof(buffer) - 1, 0,
+                           (struct sockaddr *)&address, (socklen_t *)&addrlen);
+        if (valread < 0 ||
+            connect(server_fd, (struct sockaddr *)&address, addrlen) < 0) {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+        printf("%s\n", buffer);
+        send(server_fd, hello, strlen(hello), 0);
+        printf("Hello message sent\n");
+        return {server_fd};
+    }
+    if (listen(server_fd, std::max(n_peers, 3)) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
-    if ((new_socket = accept(server_fd, (struct sockaddr *)&address,
-                             (socklen_t *)&addrlen)) < 0) {
-        perror("accept");
-        exit(EXIT_FAILURE);
+    std::vector<int> sockets;
+    while ((int)sockets.size() < n_peers) {
+        if ((new_socket = accept(server_fd, (struct sockaddr *)&address,
+                                 (socklen_t *)&addrlen)) < 0) {
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+
+        fd.fd = new_socket;
+        fd.events = POLLIN | POLLERR;
+
+        while (1) {
+            poll(&fd, 1, 10);
+            if (fd.revents & POLLIN) {
+                valread = read(new_socket, buffer, 1024);
+                printf("%s\n", buffer);
+                send(new_socket, hello, strlen(hello), 0);
+                printf("Hello message sent\n");
+                break;
+            }
+        }
+        sockets.push_back(new_socket);
+        printf("Peer %zu of %d connected\n", sockets.size(), n_peers);
     }
+    return sockets;
+}
+
+// Returns false when the program should exit.
+bool parse_options(int argc, char *argv[],
+                   connector::ConnectorOptions &connector_options,
+                   camera::SegmentationOptions &segmentation,
+                   camera::RecordingOptions &recording, int &n_peers) {
+    boost::program_options::options_description desc{"Options"};
+    desc.add_options()("help,h", "Help screen")(
+        "frame-mode",
+        boost::program_options::value<std::string>()->default_value("depth"),
+        "How geometry is sent (xyz / depth)")(
+        "codec",
+        boost::program_options::value<std::string>()->default_value(
+            connector_options.codec),
+        "Codec of the geometry sections: none, zlib[:0-9], lz4[:acceleration], "
+        "zstd[:level], bitpack or rvl (depth)")(
+        "section-codec",
+        boost::program_options::value<std::vector<std::string>>()->composing(),
+        "Codec of one section type, e.g. z=zstd:3 or u=lz4. Can be "
+        "repeated.")(
+        "codec-streams",
+        "Compress each section type as one zlib or zstd stream, restarted at "
+        "every keyframe, so that frames refer to the previous ones. Both ends "
+        "must use it.")(
+        "codec-dictionary", boost::program_options::value<std::string>(),
+        "File which primes the codec streams, e.g. one trained with zstd "
+        "--train. Both ends must use the same one.")(
+        "predictor",
+        boost::program_options::value<std::string>()->default_value(
+            predict::predictor_name(connector_options.predictor)),
+        "Spatial predictor of 16-bit images: none, left, up, average, paeth, "
+        "med or adaptive (the best one per row)")(
+        "color-codec",
+        boost::program_options::value<std::string>()->default_value("jpeg"),
+        "How the color image is sent: jpeg (every frame on its own) or vp8 "
+        "(inter frames between keyframes, needs libvpx)")(
+        "jpeg-subsampling",
+        boost::program_options::value<std::string>()->default_value(
+            jpeg_codec::subsampling_name(connector_options.jpeg_subsampling)),
+        "Chroma subsampling of the color image: 444, 422 or 420 (444 and 422 "
+        "need libjpeg-turbo or OpenCV 4.5.5)")(
+        "quantizer",
+        boost::program_options::value<std::string>()->default_value("range"),
+        "How x, y and z of xyz frames are quantized: range (2^bits levels "
+        "over the range of the frame), step (a fixed step) or inverse "
+        "(as range, with z quantized as 1/z)")(
+        "quantization-bits",
+        boost::program_options::value<int>()->default_value(
+            connector_options.quantization_bits),
+        "Bit depth of the range and inverse quantizers, 1-16 (0: chosen by "
+        "the rate controller)")(
+        "quantization-step",
+        boost::program_options::value<float>()->default_value(
+            connector_options.quantization_step * 1000.0f),
+        "Step of the step quantizer in millimetres. The error is at most "
+        "half of it.")(
+        "face-roi",
+        "Spend most of the bits on the face found by the eye tracker and send "
+        "the background at lower resolution and quality")(
+        "background-scale",
+        boost::program_options::value<int>()->default_value(
+            connector_options.background_scale),
+        "With --face-roi, how many times smaller the background of the color "
+        "image is sent")(
+        "background-jpeg-quality",
+        boost::program_options::value<int>()->default_value(
+            connector_options.background_jpeg_quality),
+        "With --face-roi, the highest JPEG quality of the background, 1-100")(
+        "background-depth-step",
+        boost::program_options::value<int>()->default_value(
+            connector_options.background_depth_step),
+        "With --face-roi, the quantization step of the background depth in "
+        "depth units")(
+        "send-interval",
+        boost::program_options::value<int>()->default_value(
+            connector_options.send_interval),
+        "Send every n-th camera frame (0: adapt the frame rate and the "
+        "quality to the connection)")(
+        "keyframe-interval",
+        boost::program_options::value<int>()->default_value(
+            connector_options.keyframe_interval),
+        "Send every n-th depth frame whole and the others as residuals "
+        "against the previous one (1: no residuals)")(
+        "temporal-step",
+        boost::program_options::value<int>()->default_value(
+            connector_options.temporal_step),
+        "Quantization step of depth residuals in depth units (1: lossless)")(
+        "near-clip",
+        boost::program_options::value<float>()->default_value(
+            segmentation.near_clip),
+        "Drop the points closer than this in metres (0: none)")(
+        "far-clip",
+        boost::program_options::value<float>()->default_value(
+            segmentation.far_clip),
+        "Drop the points farther than this in metres (0: none)")(
+        "foreground",
+        "Keep only the largest connected region of the depth image")(
+        "record", boost::program_options::value<std::string>(),
+        "Append the RealSense frames and the eye positions to this file")(
+        "replay", boost::program_options::value<std::string>(),
+        "Send frames from a file written with --record instead of a camera")(
+        "replay-speed",
+        boost::program_options::value<std::string>()->default_value(
+            "original"),
+        "With --replay, play at the recorded rate (original) or as fast as "
+        "the frames are sent (max)")(
+        "replay-once", "With --replay, stop after the last frame")(
+        "transport",
+        boost::program_options::value<std::string>()->default_value("tcp"),
+        "How frames travel: tcp (every frame, in order) or udp (lost and "
+        "late frames are dropped). Both ends must use the same one.")(
+        "fec-group",
+        boost::program_options::value<int>()->default_value(
+            connector_options.fec_group),
+        "With udp, send a parity packet, which restores one lost packet, "
+        "for every n data packets (0: none)")(
+        "frame-deadline",
+        boost::program_options::value<int>()->default_value(
+            connector_options.frame_deadline_ms),
+        "With udp, drop a frame which has not arrived this many milliseconds "
+        "after its first packet")(
+        "induced-loss",
+        boost::program_options::value<double>()->default_value(
+            connector_options.induced_loss),
+        "With udp, drop each packet sent with this probability, to test "
+        "loss over loopback")(
+        "zerocopy", "Send frames with MSG_ZEROCOPY (Linux only)")(
+        "peers", boost::program_options::value<int>()->default_value(n_peers),
+        "As the server, wait for this many clients and send every frame to "
+        "all of them (tcp only)")(
+        "codec-threads",
+        boost::program_options::value<int>()->default_value(
+            connector_options.codec_threads),
+        "Threads which encode frame sections, and as many which decode them "
+        "(0: none)");
 
-    fd.fd = new_socket;
-    fd.events = POLLIN | POLLERR;
+    boost::program_options::variables_map vm;
+    store(parse_command_line(argc, argv, desc), vm);
+    notify(vm);
 
-    while (1) {
-        poll(&fd, 1, 10);
-        if (fd.revents & POLLIN) {
-            valread = read(new_socket, buffer, 1024);
-            printf("%s\n", buffer);
-            send(new_socket, hello, strlen(hello), 0);
-            printf("Hello message sent\n");
-            break;
+    if (vm.count("help")) {
+        std::cout << desc << '\n';
+        return false;
+    }
+
+    std::string frame_mode = vm["frame-mode"].as<std::string>();
+    if (frame_mode == "xyz") {
+        connector_options.frame_mode = connector::FrameMode::XYZ;
+    } else if (frame_mode == "depth") {
+        connector_options.frame_mode = connector::FrameMode::DEPTH;
+    } else {
+        throw boost::program_options::invalid_option_value(frame_mode);
+    }
+    connector_options.codec = vm["codec"].as<std::string>();
+    make_codec(connector_options.codec);
+    if (vm.count("section-codec")) {
+        for (const auto &s :
+             vm["section-codec"].as<std::vector<std::string>>()) {
+            size_t eq = s.find('=');
+            connector::SectionType type;
+            if (eq == std::string::npos ||
+                !frame_format::section_type_from_name(s.substr(0, eq), type)) {
+                throw boost::program_options::invalid_option_value(s);
+            }
+            connector_options.section_codecs[type] = s.substr(eq + 1);
+            make_codec(s.substr(eq + 1));
+        }
+    }
+    if (vm.count("codec-streams")) {
+        connector_options.codec_streams = true;
+    }
+    if (vm.count("codec-dictionary")) {
+        const std::string path = vm["codec-dictionary"].as<std::string>();
+        std::ifstream f(path, std::ios::in | std::ios::binary);
+        if (!f) {
+            throw boost::program_options::invalid_option_value(path);
+        }
+        connector_options.codec_dictionary.assign(
+            std::istreambuf_iterator<char>(f),
+            std::istreambuf_iterator<char>());
+    }
+    std::string predictor = vm["predictor"].as<std::string>();
+    if (!predict::predictor_from_name(predictor,
+                                      connector_options.predictor)) {
+        throw boost::program_options::invalid_option_value(predictor);
+    }
+    std::string color_codec = vm["color-codec"].as<std::string>();
+    if (color_codec == "jpeg") {
+        connector_options.color_codec = connector::ColorCodec::JPEG;
+    } else if (color_codec == "vp8" && video_codec::available()) {
+        connector_options.color_codec = connector::ColorCodec::VP8;
+    } else {
+        throw boost::program_options::invalid_option_value(color_codec);
+    }
+    std::string subsampling = vm["jpeg-subsampling"].as<std::string>();
+    if (!jpeg_codec::subsampling_from_name(
+            subsampling, connector_options.jpeg_subsampling) ||
+        !jpeg_codec::subsampling_available(
+            connector_options.jpeg_subsampling)) {
+        throw boost::program_options::invalid_option_value(subsampling);
+    }
+    std::string quantizer = vm["quantizer"].as<std::string>();
+    if (quantizer == "range") {
+        connector_options.quantizer = connector::QuantizerMode::RANGE;
+    } else if (quantizer == "step") {
+        connector_options.quantizer = connector::QuantizerMode::STEP;
+    } else if (quantizer == "inverse") {
+        connector_options.quantizer = connector::QuantizerMode::INVERSE;
+    } else {
+        throw boost::program_options::invalid_option_value(quantizer);
+    }
+    const int quantization_bits = vm["quantization-bits"].as<int>();
+    if (quantization_bits < 0 || quantization_bits > 16) {
+        throw boost::program_options::invalid_option_value(
+            std::to_string(quantization_bits));
+    }
+    connector_options.quantization_bits = quantization_bits;
+    const float quantization_step = vm["quantization-step"].as<float>();
+    if (!(quantization_step > 0.0f)) {
+        throw boost::program_options::invalid_option_value(
+            std::to_string(quantization_step));
+    }
+    connector_options.quantization_step = quantization_step / 1000.0f;
+    if (vm.count("face-roi")) {
+        connector_options.face_roi = true;
+    }
+    const int background_jpeg_quality =
+        vm["background-jpeg-quality"].as<int>();
+    if (background_jpeg_quality < 1 || background_jpeg_quality > 100) {
+        throw boost::program_options::invalid_option_value(
+            std::to_string(background_jpeg_quality));
+    }
+    connector_options.background_jpeg_quality = background_jpeg_quality;
+    for (const char *name :
+         {"send-interval", "keyframe-interval", "temporal-step",
+          "background-scale", "background-depth-step"}) {
+        const int min = std::string(name) == "send-interval" ? 0 : 1;
+        if (vm[name].as<int>() < min) {
+            throw boost::program_options::invalid_option_value(
+                std::to_string(vm[name].as<int>()));
+        }
+    }
+    connector_options.send_interval = vm["send-interval"].as<int>();
+    connector_options.keyframe_interval = vm["keyframe-interval"].as<int>();
+    connector_options.temporal_step = vm["temporal-step"].as<int>();
+    connector_options.background_scale = vm["background-scale"].as<int>();
+    connector_options.background_depth_step =
+        vm["background-depth-step"].as<int>();
+    std::string transport = vm["transport"].as<std::string>();
+    if (transport == "udp") {
+        connector_options.transport = connector::Transport::UDP;
+    } else if (transport != "tcp") {
+        throw boost::program_options::invalid_option_value(transport);
+    }
+    if (connector_options.transport == connector::Transport::UDP &&
+        connector_options.codec_streams) {
+        // A lost frame would break the streams for the rest of the session.
+        throw boost::program_options::error(
+            "--codec-streams needs --transport tcp");
+    }
+    if (vm["fec-group"].as<int>() < 0 || vm["fec-group"].as<int>() > 0xffff) {
+        throw boost::program_options::invalid_option_value(
+            std::to_string(vm["fec-group"].as<int>()));
+    }
+    connector_options.fec_group = vm["fec-group"].as<int>();
+    if (vm["frame-deadline"].as<int>() < 1) {
+        throw boost::program_options::invalid_option_value(
+            std::to_string(vm["frame-deadline"].as<int>()));
+    }
+    connector_options.frame_deadline_ms = vm["frame-deadline"].as<int>();
+    const double induced_loss = vm["induced-loss"].as<double>();
+    if (induced_loss < 0.0 || induced_loss > 1.0) {
+        throw boost::program_options::invalid_option_value(
+            std::to_string(induced_loss));
+    }
+    connector_options.induced_loss = induced_loss;
+    n_peers = vm["peers"].as<int>();
+    if (n_peers < 1) {
+        throw boost::program_options::invalid_option_value(
+            std::to_string(n_peers));
+    }
+    if (n_peers > 1 &&
+        connector_options.transport != connector::Transport::TCP) {
+        throw boost::program_options::error("--peers needs --transport tcp");
+    }
+    if (n_peers > 1 && connector_options.codec_streams) {
+        // With codec streams, frames are never dropped for a peer which
+        // falls behind, so it would hold up the others.
+        throw boost::program_options::error(
+            "--codec-streams cannot be used with --peers");
+    }
+    if (vm.count("zerocopy")) {
+        connector_options.zerocopy = true;
+    }
+    connector_options.codec_threads = vm["codec-threads"].as<int>();
+    for (const char *name : {"near-clip", "far-clip"}) {
+        if (vm[name].as<float>() < 0.0f) {
+            throw boost::program_options::invalid_option_value(
+                std::to_string(vm[name].as<float>()));
         }
     }
-    return new_socket;
+    segmentation.near_clip = vm["near-clip"].as<float>();
+    segmentation.far_clip = vm["far-clip"].as<float>();
+    if (vm.count("foreground")) {
+        segmentation.largest_component = true;
+    }
+    if (vm.count("record")) {
+        recording.record_path = vm["record"].as<std::string>();
+    }
+    if (vm.count("replay")) {
+        recording.replay_path = vm["replay"].as<std::string>();
+    }
+    std::string replay_speed = vm["replay-speed"].as<std::string>();
+    if (replay_speed == "max") {
+        recording.max_speed = true;
+    } else if (replay_speed != "original") {
+        throw boost::program_options::invalid_option_value(replay_speed);
+    }
+    if (vm.count("replay-once")) {
+        recording.loop = false;
+    }
+    return true;
 }
 
 int main(int argc, char *argv[]) {
     // Initialize Google's logging library.
     google::InitGoogleLogging(argv[0]);
 
-    int socket = -1;
-    int use_realsense;
+    connector::ConnectorOptions connector_options;
+    camera::SegmentationOptions segmentation;
+    camera::RecordingOptions recording;
+    int n_peers = 1;
+    try {
+        if (!parse_options(argc, argv, connector_options, segmentation,
+                           recording, n_peers)) {
+            return 0;
+        }
+    } catch (const boost::program_options::error &ex) {
+        std::cerr << ex.what() << '\n';
+        return 1;
+    } catch (const std::invalid_argument &ex) {
+        // From make_codec
+        std::cerr << ex.what() << '\n';
+        return 1;
+    }
+
+    // None in debug mode.
+    std::vector<int> sockets;
+    int use_realsense = 1;
     int connection_type;
 
-    std::cout << "Realsense or webcam (1: realsense / 2: webcam) > ";
-    std::cin >> use_realsense;
+    // A recording replaces the camera.
+    if (recording.replay_path.empty()) {
+        std::cout << "Realsense or webcam (1: realsense / 2: webcam) > ";
+        std::cin >> use_realsense;
+    }
     if (use_realsense != 1 && use_realsense != 2) {
         std::cout << "Invalid input: " << use_realsense << std::endl;
         return 0;
@@ -156,9 +530,11 @@ int main(int argc, char *argv[]) {
         LOG(FATAL) << "Invalid connection type: " << connection_type;
         return 0;
     } else if (connection_type == 1) {
-        socket = setup_server();
+        sockets = setup_server(
+            connector_options.transport == connector::Transport::UDP, n_peers);
     } else if (connection_type == 2) {
-        socket = setup_client();
+        sockets.push_back(setup_client(connector_options.transport ==
+                                       connector::Transport::UDP));
     }
 
     ThreadSafeState<eye_like::EyesPosition> eye_pos;
@@ -175,10 +551,11 @@ int main(int argc, char *argv[]) {
 
     std::thread th_camera(camera::camera_main_loop, std::ref(eye_pos_put),
                           std::ref(frame_camera_connector_push), use_realsense,
-                          false);
+                          false, segmentation, recording);
     std::thread th_connector(connector::connector_main_loop,
                              std::ref(frame_connector_renderer_push),
-                             std::ref(frame_camera_connector_pop), socket);
+                             std::ref(frame_camera_connector_pop), sockets,
+                             connector_options);
 
     // Render on main thread because of Mac OS.
     renderer::renderer_main_loop(eye_pos_get, frame_connector_renderer_pop,
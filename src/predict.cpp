@@ -0,0 +1,337 @@
+#include "predict.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace predict {
+namespace {
+
+const Predictor row_predictors[] = {Predictor::NONE,    Predictor::LEFT,
+                                    Predictor::UP,      Predictor::AVERAGE,
+                                    Predictor::PAETH,   Predictor::MED};
+
+struct PredictNone {
+    static int predict(int, int, int) { return 0; }
+};
+
+struct PredictLeft {
+    static int predict(int a, int, int) { return a; }
+};
+
+struct PredictUp {
+    static int predict(int, int b, int) { return b; }
+};
+
+struct PredictAverage {
+    static int predict(int a, int b, int) { return (a + b) >> 1; }
+};
+
+struct PredictPaeth {
+    static int predict(int a, int b, int c) {
+        const int p = a + b - c;
+        const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        if (pa <= pb && pa <= pc)
+            return a;
+        return pb <= pc ? b : c;
+    }
+};
+
+struct PredictMed {
+    static int predict(int a, int b, int c) {
+        if (c >= std::max(a, b))
+            return std::min(a, b);
+        if (c <= std::min(a, b))
+            return std::max(a, b);
+        return a + b - c;
+    }
+};
+
+// up is nullptr for the first row. Returns the sum of the absolute residuals.
+template <class P>
+uint64_t filter_row(const uint16_t *row, const uint16_t *up, int width,
+                    uint16_t *out) {
+    uint64_t cost = 0;
+    int a = 0, c = 0;
+    for (int x = 0; x < width; x++) {
+        const int b = up ? up[x] : 0;
+        const uint16_t d = (uint16_t)(row[x] - P::predict(a, b, c));
+        cost += abs((int16_t)d);
+        out[x] = zigzag(d);
+        a = row[x];
+        c = b;
+    }
+    return cost;
+}
+
+template <class P>
+void unfilter_row(const uint16_t *in, const uint16_t *up, int width,
+                  uint16_t *row) {
+    int a = 0, c = 0;
+    for (int x = 0; x < width; x++) {
+        const int b = up ? up[x] : 0;
+        row[x] = (uint16_t)(P::predict(a, b, c) + unzigzag(in[x]));
+        a = row[x];
+        c = b;
+    }
+}
+
+uint64_t filter_row(Predictor predictor, const uint16_t *row,
+                    const uint16_t *up, int width, uint16_t *out) {
+    switch (predictor) {
+    case Predictor::LEFT:
+        return filter_row<PredictLeft>(row, up, width, out);
+    case Predictor::UP:
+        return filter_row<PredictUp>(row, up, width, out);
+    case Predictor::AVERAGE:
+        return filter_row<PredictAverage>(row, up, width, out);
+    case Predictor::PAETH:
+        return filter_row<PredictPaeth>(row, up, width, out);
+    case Predictor::MED:
+        return filter_row<PredictMed>(row, up, width, out);
+    default:
+        return filter_row<PredictNone>(row, up, width, out);
+    }
+}
+
+bool unfilter_row(Predictor predictor, const uint16_t *in, const uint16_t *up,
+                  int width, uint16_t *row) {
+    switch (predictor) {
+    case Predictor::NONE:
+        unfilter_row<PredictNone>(in, up, width, row);
+        return true;
+    case Predictor::LEFT:
+        unfilter_row<PredictLeft>(in, up, width, row);
+        return true;
+    case Predictor::UP:
+        unfilter_row<PredictUp>(in, up, width, row);
+        return true;
+    case Predictor::AVERAGE:
+        unfilter_row<PredictAverage>(in, up, width, row);
+        return true;
+    case Predictor::PAETH:
+        unfilter_row<PredictPaeth>(in, up, width, row);
+        return true;
+    case Predictor::MED:
+        unfilter_row<PredictMed>(in, up, width, row);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// As unfilter_row, but only the samples at the indices from coded to
+// coded_end have a residual in `in`. Both are advanced past the row.
+template <class P>
+void unfilter_sparse_row(const uint16_t *&in, const uint32_t *&coded,
+                         const uint32_t *coded_end, uint32_t row_index,
+                         const uint16_t *up, int width, uint16_t *row) {
+    int a = 0, c = 0;
+    for (int x = 0; x < width; x++) {
+        const int b = up ? up[x] : 0;
+        if (coded != coded_end && *coded == row_index + x) {
+            row[x] = (uint16_t)(P::predict(a, b, c) + unzigzag(*in++));
+            coded++;
+        } else {
+            row[x] = (uint16_t)(x > 0 ? a : b);
+        }
+        a = row[x];
+        c = b;
+    }
+}
+
+bool unfilter_sparse_row(Predictor predictor, const uint16_t *&in,
+                         const uint32_t *&coded, const uint32_t *coded_end,
+                         uint32_t row_index, const uint16_t *up, int width,
+                         uint16_t *row) {
+    switch (predictor) {
+    case Predictor::NONE:
+        unfilter_sparse_row<PredictNone>(in, coded, coded_end, row_index, up,
+                                         width, row);
+        return true;
+    case Predictor::LEFT:
+        unfilter_sparse_row<PredictLeft>(in, coded, coded_end, row_index, up,
+                                         width, row);
+        return true;
+    case Predictor::UP:
+        unfilter_sparse_row<PredictUp>(in, coded, coded_end, row_index, up,
+                                       width, row);
+        return true;
+    case Predictor::AVERAGE:
+        unfilter_sparse_row<PredictAverage>(in, coded, coded_end, row_index,
+                                            up, width, row);
+        return true;
+    case Predictor::PAETH:
+        unfilter_sparse_row<PredictPaeth>(in, coded, coded_end, row_index, up,
+                                          width, row);
+        return true;
+    case Predictor::MED:
+        unfilter_sparse_row<PredictMed>(in, coded, coded_end, row_index, up,
+                                        width, row);
+        return true;
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+const char *predictor_name(Predictor predictor) {
+    switch (predictor) {
+    case Predictor::NONE:
+        return "none";
+    case Predictor::LEFT:
+        return "left";
+    case Predictor::UP:
+        return "up";
+    case Predictor::AVERAGE:
+        return "average";
+    case Predictor::PAETH:
+        return "paeth";
+    case Predictor::MED:
+        return "med";
+    case Predictor::ADAPTIVE:
+        return "adaptive";
+    }
+    return "unknown";
+}
+
+bool predictor_from_name(const std::string &name, Predictor &predictor) {
+    for (Predictor p : row_predictors) {
+        if (name == predictor_name(p)) {
+            predictor = p;
+            return true;
+        }
+    }
+    if (name == predictor_name(Predictor::ADAPTIVE)) {
+        predictor = Predictor::ADAPTIVE;
+        return true;
+    }
+    return false;
+}
+
+size_t filtered_length(Predictor predictor, int width, int height) {
+    size_t length = (size_t)width * height;
+    if (predictor == Predictor::ADAPTIVE) {
+        length += height;
+    }
+    return length;
+}
+
+void filter(Predictor predictor, const uint16_t *image, int width, int height,
+            uint16_t *filtered) {
+    if (predictor != Predictor::ADAPTIVE) {
+        for (int y = 0; y < height; y++) {
+            filter_row(predictor, image + (size_t)y * width,
+                       y > 0 ? image + (size_t)(y - 1) * width : nullptr,
+                       width, filtered + (size_t)y * width);
+        }
+        return;
+    }
+
+    // Every row is filtered with each predictor into out and the best one
+    // is kept in place.
+    uint16_t *row_predictor = filtered;
+    uint16_t *out = filtered + height;
+    // Sections filter on the pool, so each thread has its own.
+    thread_local std::vector<uint16_t> candidate;
+    candidate.resize(width);
+    for (int y = 0; y < height; y++) {
+        const uint16_t *row = image + (size_t)y * width;
+        const uint16_t *up = y > 0 ? row - width : nullptr;
+        uint16_t *best = out + (size_t)y * width;
+        uint64_t best_cost = filter_row(Predictor::NONE, row, up, width, best);
+        row_predictor[y] = (uint16_t)Predictor::NONE;
+        for (Predictor p : row_predictors) {
+            if (p == Predictor::NONE)
+                continue;
+            uint64_t cost = filter_row(p, row, up, width, candidate.data());
+            if (cost < best_cost) {
+                best_cost = cost;
+                row_predictor[y] = (uint16_t)p;
+                std::copy(candidate.begin(), candidate.end(), best);
+            }
+        }
+    }
+}
+
+size_t filtered_sparse_length(Predictor predictor, size_t n_coded,
+                              int height) {
+    return predictor == Predictor::ADAPTIVE ? n_coded + height : n_coded;
+}
+
+void filter_sparse(Predictor predictor, uint16_t *image, int width,
+                   int height, const uint32_t *coded, size_t n_coded,
+                   uint16_t *filtered) {
+    const uint32_t *next = coded;
+    const uint32_t *end = coded + n_coded;
+    for (int y = 0; y < height; y++) {
+        uint16_t *row = image + (size_t)y * width;
+        const uint32_t row_index = (uint32_t)y * width;
+        for (int x = 0; x < width; x++) {
+            if (next != end && *next == row_index + x) {
+                next++;
+            } else {
+                row[x] = x > 0 ? row[x - 1] : y > 0 ? row[x - width] : 0;
+            }
+        }
+    }
+
+    // The whole image is filtered, and the residuals of the filled samples
+    // are left out.
+    thread_local std::vector<uint16_t> whole;
+    whole.resize(filtered_length(predictor, width, height));
+    filter(predictor, image, width, height, whole.data());
+    const size_t n_row_predictors =
+        predictor == Predictor::ADAPTIVE ? height : 0;
+    std::copy(whole.begin(), whole.begin() + n_row_predictors, filtered);
+    const uint16_t *residuals = whole.data() + n_row_predictors;
+    for (size_t i = 0; i < n_coded; i++) {
+        filtered[n_row_predictors + i] = residuals[coded[i]];
+    }
+}
+
+bool unfilter_sparse(Predictor predictor, const uint16_t *filtered, int width,
+                     int height, const uint32_t *coded, size_t n_coded,
+                     uint16_t *image) {
+    const uint16_t *in = filtered;
+    if (predictor == Predictor::ADAPTIVE) {
+        in += height;
+    }
+    const uint32_t *next = coded;
+    const uint32_t *end = coded + n_coded;
+    for (int y = 0; y < height; y++) {
+        Predictor p = predictor == Predictor::ADAPTIVE
+                          ? (Predictor)filtered[y]
+                          : predictor;
+        if (!unfilter_sparse_row(
+                p, in, next, end, (uint32_t)y * width,
+                y > 0 ? image + (size_t)(y - 1) * width : nullptr, width,
+                image + (size_t)y * width)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool unfilter(Predictor predictor, const uint16_t *filtered, int width,
+              int height, uint16_t *image) {
+    const uint16_t *in = filtered;
+    if (predictor == Predictor::ADAPTIVE) {
+        in += height;
+    }
+    for (int y = 0; y < height; y++) {
+        Predictor p = predictor == Predictor::ADAPTIVE
+                          ? (Predictor)filtered[y]
+                          : predictor;
+        if (!unfilter_row(p, in + (size_t)y * width,
+                          y > 0 ? image + (size_t)(y - 1) * width : nullptr,
+                          width, image + (size_t)y * width)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace predict
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Spatial prediction of organized 16-bit images before entropy coding. Every
+// sample is replaced with the zigzag-encoded difference from a prediction made
+// from its left (a), upper (b) and upper-left (c) neighbours. Neighbours
+// outside the image are 0. Neighbouring samples of depth and XYZ images are
+// close, so the residuals are small and compress far better than the samples.
+namespace predict {
+
+enum class Predictor : uint32_t {
+    NONE = 0,
+    LEFT = 1,
+    UP = 2,
+    // (a + b) / 2
+    AVERAGE = 3,
+    // The one of a, b and c closest to a + b - c, as in PNG.
+    PAETH = 4,
+    // The median edge detector of LOCO-I.
+    MED = 5,
+    // The best of the above for each row, chosen by the sum of the absolute
+    // residuals. The filtered image starts with the predictor of every row.
+    ADAPTIVE = 6,
+};
+
+// Maps small differences of either sign to small unsigned values.
+inline uint16_t zigzag(uint16_t d) {
+    return (uint16_t)((d << 1) ^ (uint16_t)((int16_t)d >> 15));
+}
+
+inline uint16_t unzigzag(uint16_t z) {
+    return (uint16_t)((z >> 1) ^ (uint16_t)(-(int16_t)(z & 1)));
+}
+
+const char *predictor_name(Predictor predictor);
+
+// The inverse of predictor_name. Returns false for an unknown name.
+bool predictor_from_name(const std::string &name, Predictor &predictor);
+
+// The number of samples filter writes.
+size_t filtered_length(Predictor predictor, int width, int height);
+
+void filter(Predictor predictor, const uint16_t *image, int width, int height,
+            uint16_t *filtered);
+
+// The inverse of filter. Returns false when a row predictor is invalid.
+bool unfilter(Predictor predictor, const uint16_t *filtered, int width,
+              int height, uint16_t *image);
+
+// As filter and unfilter for images of which only the samples at the sorted
+// indices in `coded` are sent, such as the channels of the valid points. Each
+// other sample takes the value of its left neighbour, or of its upper one at
+// the start of a row, so the coded samples keep their neighbours in both
+// directions. The filtered image holds the row predictors of ADAPTIVE and
+// then the residuals of the coded samples.
+size_t filtered_sparse_length(Predictor predictor, size_t n_coded,
+                              int height);
+
+// Fills the samples of image which are not coded.
+void filter_sparse(Predictor predictor, uint16_t *image, int width,
+                   int height, const uint32_t *coded, size_t n_coded,
+                   uint16_t *filtered);
+
+bool unfilter_sparse(Predictor predictor, const uint16_t *filtered, int width,
+                     int height, const uint32_t *coded, size_t n_coded,
+                     uint16_t *image);
+
+} // namespace predict
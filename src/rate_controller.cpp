@@ -0,0 +1,154 @@
+#include "rate_controller.h"
+
+#include <algorithm>
+
+namespace connector {
+
+namespace {
+
+struct Quality {
+    int jpeg_quality;
+    int quantization_bits;
+    int depth_step;
+};
+
+// From the best to the worst.
+const Quality qualities[] = {
+    {95, 12, 1}, {85, 11, 1}, {75, 10, 2}, {60, 9, 4}, {45, 8, 8},
+};
+const int N_QUALITIES = sizeof(qualities) / sizeof(qualities[0]);
+
+// Weight of a new throughput sample.
+const double THROUGHPUT_GAIN = 0.25;
+// Weight of a new frame length.
+const double FRAME_BYTES_GAIN = 0.25;
+// Use this much of the estimated throughput while the connection is the
+// bottleneck, and probe for this much more than is sent while it is not.
+const double UTILIZATION = 0.9;
+const double PROBE = 1.25;
+// Above this queueing delay the frame rate is halved to drain the queue and
+// no frame is sent.
+const double MAX_QUEUE_DELAY = 0.2;
+// Below this frame rate quality is lowered.
+const double MIN_FPS = 5.0;
+// Seconds between quality changes, so that the frame length has settled.
+const double QUALITY_DOWN_INTERVAL = 1.0;
+const double QUALITY_UP_INTERVAL = 3.0;
+
+double seconds(RateController::Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+} // namespace
+
+RateController::RateController(double max_fps_) : max_fps(max_fps_) {
+    // Start at the rate of the old fixed schedule until there is an estimate.
+    current.fps = max_fps / 5;
+    set_quality(0, Clock::now());
+}
+
+void RateController::set_quality(int level, Clock::time_point now) {
+    quality_level = level;
+    current.jpeg_quality = qualities[level].jpeg_quality;
+    current.quantization_bits = qualities[level].quantization_bits;
+    current.depth_step = qualities[level].depth_step;
+    last_quality_change = now;
+}
+
+bool RateController::should_send(Clock::time_point now) {
+    if (throughput > 0.0 && queued / throughput > MAX_QUEUE_DELAY) {
+        return false;
+    }
+    // Frames come from the camera at max_fps, so allow half a camera frame of
+    // jitter.
+    const auto tolerance = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(0.5 / max_fps));
+    if (now + tolerance < next_send) {
+        return false;
+    }
+    const auto period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1.0 / current.fps));
+    // Do not build up more than one period of missed sends.
+    next_send = std::max(next_send, now - period) + period;
+    return true;
+}
+
+void RateController::on_sent(size_t length) {
+    frame_bytes = frame_bytes > 0.0 ? (1 - FRAME_BYTES_GAIN) * frame_bytes +
+                                          FRAME_BYTES_GAIN * length
+                                    : length;
+}
+
+void RateController::on_socket_state(uint64_t bytes_written,
+                                     size_t queued_bytes,
+                                     Clock::time_point now) {
+    queued = queued_bytes;
+    const uint64_t delivered = bytes_written - queued_bytes;
+    if (!has_sample) {
+        has_sample = true;
+        sample_time = now;
+        sample_delivered = delivered;
+        sample_backlogged = queued_bytes > 0;
+        return;
+    }
+    const double dt = seconds(now - sample_time);
+    if (dt < SAMPLE_INTERVAL) {
+        return;
+    }
+
+    // Samples of the socket are not taken atomically with the writes, so
+    // delivered may seem to go back a little. Wait for it to catch up.
+    if (delivered < sample_delivered) {
+        return;
+    }
+    const double rate = (delivered - sample_delivered) / dt;
+    // The queue was never empty, as far as we can tell.
+    const bool backlogged = sample_backlogged && queued_bytes > 0;
+    if (backlogged) {
+        throughput = throughput > 0.0 ? (1 - THROUGHPUT_GAIN) * throughput +
+                                            THROUGHPUT_GAIN * rate
+                                      : rate;
+    } else {
+        // Only a lower bound of what the connection can do.
+        throughput = std::max(throughput, rate);
+    }
+    sample_time = now;
+    sample_delivered = delivered;
+    sample_backlogged = queued_bytes > 0;
+
+    update_targets(backlogged, now);
+}
+
+void RateController::update_targets(bool backlogged,
+                                    Clock::time_point now) {
+    if (throughput <= 0.0 || frame_bytes <= 0.0) {
+        return;
+    }
+    const double queue_delay = queued / throughput;
+    double budget = throughput * (backlogged ? UTILIZATION : PROBE);
+    if (queue_delay > MAX_QUEUE_DELAY) {
+        budget /= 2;
+    }
+    const double fps = budget / frame_bytes;
+
+    const double since_change = seconds(now - last_quality_change);
+    if (fps < MIN_FPS && quality_level + 1 < N_QUALITIES &&
+        since_change >= QUALITY_DOWN_INTERVAL) {
+        set_quality(quality_level + 1, now);
+    } else if (fps >= max_fps && !backlogged && quality_level > 0 &&
+               since_change >= QUALITY_UP_INTERVAL) {
+        set_quality(quality_level - 1, now);
+    }
+    current.fps = std::clamp(fps, 1.0, max_fps);
+}
+
+RateStats RateController::stats() const {
+    RateStats s;
+    s.throughput = throughput;
+    s.frame_bytes = frame_bytes;
+    s.queue_delay = throughput > 0.0 ? queued / throughput : 0.0;
+    s.targets = current;
+    return s;
+}
+
+} // namespace connector
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace connector {
+
+struct RateTargets {
+    double fps;
+    int jpeg_quality;
+    // Bits of the quantized XYZ channels.
+    int quantization_bits;
+    // The smallest quantization step of depth residuals.
+    int depth_step;
+};
+
+struct RateStats {
+    // The estimated throughput of the connection in bytes per second. 0 until
+    // the first estimate.
+    double throughput;
+    // The average length of the frames sent recently.
+    double frame_bytes;
+    // How long the bytes queued in the socket take to drain, in seconds.
+    double queue_delay;
+    RateTargets targets;
+};
+
+// Chooses the frame rate and the quality of frames so that they fit the
+// throughput of the connection. The throughput is estimated from how fast the
+// socket send queue drains. While the queue stays non-empty the connection is
+// the bottleneck and the drain rate is its throughput. While it runs empty
+// the sender is the bottleneck, so the frame rate is raised to probe for
+// more, and quality is raised once the frame rate is at its maximum. Quality
+// is lowered when even the minimum frame rate does not fit.
+class RateController {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // Seconds between throughput samples.
+    static constexpr double SAMPLE_INTERVAL = 0.1;
+
+    explicit RateController(double max_fps);
+
+    // Called for every captured frame. Returns true when it should be sent.
+    bool should_send(Clock::time_point now);
+
+    // Called with the length of every sent frame.
+    void on_sent(size_t frame_bytes);
+
+    // Called at least every SAMPLE_INTERVAL with the bytes written to the
+    // socket so far and the bytes still queued in it.
+    void on_socket_state(uint64_t bytes_written, size_t queued_bytes,
+                         Clock::time_point now);
+
+    const RateTargets &targets() const { return current; }
+    RateStats stats() const;
+
+  private:
+    void update_targets(bool backlogged, Clock::time_point now);
+    void set_quality(int level, Clock::time_point now);
+
+    const double max_fps;
+    RateTargets current;
+    int quality_level = 0;
+    Clock::time_point last_quality_change;
+    Clock::time_point next_send;
+
+    // The previous sample of the socket state.
+    bool has_sample = false;
+    Clock::time_point sample_time;
+    uint64_t sample_delivered = 0;
+    bool sample_backlogged = false;
+
+    double throughput = 0.0;
+    double frame_bytes = 0.0;
+    size_t queued = 0;
+};
+
+} // namespace connector
@@ -0,0 +1,145 @@
+#include "reactor.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <glog/logging.h>
+
+namespace connector {
+
+#ifdef __linux__
+
+namespace {
+
+// The EPOLL and Reactor constants are enums, so each is cast to mix with 0.
+uint32_t to_epoll(uint32_t events) {
+    return (events & Reactor::READABLE ? (uint32_t)EPOLLIN : 0u) |
+           (events & Reactor::WRITABLE ? (uint32_t)EPOLLOUT : 0u);
+}
+
+uint32_t from_epoll(uint32_t events) {
+    return (events & (EPOLLIN | EPOLLHUP) ? (uint32_t)Reactor::READABLE
+                                          : 0u) |
+           (events & EPOLLOUT ? (uint32_t)Reactor::WRITABLE : 0u) |
+           (events & EPOLLERR ? (uint32_t)Reactor::ERROR : 0u);
+}
+
+} // namespace
+
+Reactor::Reactor() : epoll_fd(epoll_create1(EPOLL_CLOEXEC)) {
+    if (epoll_fd < 0) {
+        LOG(FATAL) << "epoll_create1 failed: " << strerror(errno);
+    }
+}
+
+Reactor::~Reactor() { close(epoll_fd); }
+
+void Reactor::add(int fd, uint32_t events, Handler handler) {
+    struct epoll_event event = {};
+    event.events = to_epoll(events);
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        LOG(FATAL) << "epoll_ctl failed: " << strerror(errno);
+    }
+    handlers[fd] = {events, std::move(handler)};
+    ready.resize(handlers.size());
+}
+
+void Reactor::modify(int fd, uint32_t events) {
+    struct epoll_event event = {};
+    event.events = to_epoll(events);
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        LOG(FATAL) << "epoll_ctl failed: " << strerror(errno);
+    }
+    handlers.at(fd).first = events;
+}
+
+void Reactor::remove(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    handlers.erase(fd);
+}
+
+int Reactor::run_once(int timeout_ms) {
+    if (ready.empty()) {
+        ready.resize(1);
+    }
+    int n = epoll_wait(epoll_fd, ready.data(), ready.size(), timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR) {
+            LOG(FATAL) << "epoll_wait failed: " << strerror(errno);
+        }
+        return 0;
+    }
+    int n_run = 0;
+    for (int i = 0; i < n; i++) {
+        auto it = handlers.find(ready[i].data.fd);
+        // Removed by an earlier handler.
+        if (it == handlers.end()) {
+            continue;
+        }
+        // The handler may remove itself.
+        Handler handler = it->second.second;
+        handler(from_epoll(ready[i].events));
+        n_run++;
+    }
+    return n_run;
+}
+
+#else
+
+Reactor::Reactor() {}
+
+Reactor::~Reactor() {}
+
+void Reactor::add(int fd, uint32_t events, Handler handler) {
+    handlers[fd] = {events, std::move(handler)};
+}
+
+void Reactor::modify(int fd, uint32_t events) {
+    handlers.at(fd).first = events;
+}
+
+void Reactor::remove(int fd) { handlers.erase(fd); }
+
+int Reactor::run_once(int timeout_ms) {
+    fds.clear();
+    for (const auto &[fd, entry] : handlers) {
+        struct pollfd p = {};
+        p.fd = fd;
+        p.events = (entry.first & READABLE ? POLLIN : 0) |
+                   (entry.first & WRITABLE ? POLLOUT : 0);
+        fds.push_back(p);
+    }
+    int n = poll(fds.data(), fds.size(), timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR) {
+            LOG(FATAL) << "poll failed: " << strerror(errno);
+        }
+        return 0;
+    }
+    int n_run = 0;
+    for (const struct pollfd &p : fds) {
+        if (p.revents == 0) {
+            continue;
+        }
+        auto it = handlers.find(p.fd);
+        // Removed by an earlier handler.
+        if (it == handlers.end()) {
+            continue;
+        }
+        // The handler may remove itself.
+        Handler handler = it->second.second;
+        handler((p.revents & (POLLIN | POLLHUP) ? (uint32_t)READABLE : 0u) |
+                (p.revents & POLLOUT ? (uint32_t)WRITABLE : 0u) |
+                (p.revents & (POLLERR | POLLNVAL) ? (uint32_t)ERROR : 0u));
+        n_run++;
+    }
+    return n_run;
+}
+
+#endif
+
+} // namespace connector
@@ -0,0 +1,55 @@
+#pragma once
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+namespace connector {
+
+// Waits until file descriptors are ready and runs their handlers on the
+// thread which calls run_once. Built on epoll on Linux and on poll
+// elsewhere. Readiness is level-triggered: a handler which leaves data
+// unread runs again on the next call.
+class Reactor {
+  public:
+    enum Events : uint32_t {
+        READABLE = 1,
+        WRITABLE = 2,
+        // Reported whether it was asked for or not.
+        ERROR = 4,
+    };
+    using Handler = std::function<void(uint32_t events)>;
+
+    Reactor();
+    ~Reactor();
+
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    void add(int fd, uint32_t events, Handler handler);
+    void modify(int fd, uint32_t events);
+    // May be called from a handler, also for its own descriptor.
+    void remove(int fd);
+
+    // Waits at most timeout_ms (-1: without a limit) for a descriptor to be
+    // ready and runs the handlers of the ready ones. Returns how many ran.
+    int run_once(int timeout_ms);
+
+  private:
+    std::map<int, std::pair<uint32_t, Handler>> handlers;
+#ifdef __linux__
+    int epoll_fd;
+    std::vector<struct epoll_event> ready;
+#else
+    std::vector<struct pollfd> fds;
+#endif
+};
+
+} // namespace connector
@@ -0,0 +1,342 @@
+#include "recording.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <glog/logging.h>
+
+namespace camera {
+
+namespace {
+
+constexpr size_t ALIGNMENT = 16;
+constexpr char FILE_MAGIC[8] = "MNGOREC";
+constexpr char TRAILER_MAGIC[8] = "MNGOIDX";
+constexpr uint32_t VERSION = 1;
+// "FRAM" in little endian
+constexpr uint32_t RECORD_MAGIC = 0x4d415246;
+
+enum RecordFlags : uint32_t {
+    HAS_DEPTH = 1,
+};
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t flags;
+    // Of the whole record, including this header and the padding.
+    uint64_t length;
+    int64_t timestamp_us;
+    uint32_t width, height, n_points;
+    int32_t face_x, face_y, face_width, face_height;
+    double eyes[4];
+    // Set with HAS_DEPTH only.
+    float depth_scale;
+    rs2_intrinsics depth_intrinsics;
+    rs2_intrinsics color_intrinsics;
+    rs2_extrinsics depth_to_color;
+};
+
+struct IndexEntry {
+    uint64_t offset;
+    int64_t timestamp_us;
+};
+
+struct Trailer {
+    uint64_t index_offset;
+    uint64_t frame_count;
+    char magic[8];
+};
+
+size_t align(size_t n) { return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+size_t rgb_length(const RecordHeader &h) {
+    return (size_t)3 * h.width * h.height;
+}
+
+uint64_t record_length(const RecordHeader &h) {
+    uint64_t length = align(sizeof(RecordHeader)) + align(rgb_length(h)) +
+                      align(h.n_points * sizeof(rs2::vertex)) +
+                      align(h.n_points * sizeof(rs2::texture_coordinate));
+    if (h.flags & HAS_DEPTH) {
+        length += align(h.n_points * sizeof(uint16_t));
+    }
+    return length;
+}
+
+} // namespace
+
+RecordingWriter::RecordingWriter(const std::string &path)
+    : file(path, std::ios::out | std::ios::binary | std::ios::trunc) {
+    if (!file) {
+        throw std::runtime_error("Cannot create the recording " + path);
+    }
+    FileHeader header = {};
+    memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    write_padded(&header, sizeof(header));
+}
+
+RecordingWriter::~RecordingWriter() {
+    const uint64_t index_offset = offset;
+    for (const auto &entry : index) {
+        IndexEntry e = {entry.offset, entry.timestamp_us};
+        file.write((const char *)&e, sizeof(e));
+    }
+    Trailer trailer = {};
+    trailer.index_offset = index_offset;
+    trailer.frame_count = index.size();
+    memcpy(trailer.magic, TRAILER_MAGIC, sizeof(trailer.magic));
+    file.write((const char *)&trailer, sizeof(trailer));
+}
+
+void RecordingWriter::append(const rs2_frame_data &frame,
+                             const eye_like::EyesPosition &eyes) {
+    const auto now = std::chrono::steady_clock::now();
+    if (index.empty()) {
+        start = now;
+    }
+
+    RecordHeader h = {};
+    h.magic = RECORD_MAGIC;
+    h.timestamp_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - start)
+            .count();
+    h.width = frame.width;
+    h.height = frame.height;
+    h.n_points = frame.n_points;
+    h.face_x = frame.face.x;
+    h.face_y = frame.face.y;
+    h.face_width = frame.face.width;
+    h.face_height = frame.face.height;
+    h.eyes[0] = eyes.left_eye_center_x;
+    h.eyes[1] = eyes.left_eye_center_y;
+    h.eyes[2] = eyes.right_eye_center_x;
+    h.eyes[3] = eyes.right_eye_center_y;
+    if (frame.depth) {
+        h.flags |= HAS_DEPTH;
+        h.depth_scale = frame.depth_scale;
+        h.depth_intrinsics = frame.depth_intrinsics;
+        h.color_intrinsics = frame.color_intrinsics;
+        h.depth_to_color = frame.depth_to_color;
+    }
+    h.length = record_length(h);
+
+    index.push_back({offset, h.timestamp_us});
+    write_padded(&h, sizeof(h));
+    write_padded(frame.rgb.get(), rgb_length(h));
+    write_padded(frame.vertices.get(), h.n_points * sizeof(rs2::vertex));
+    write_padded(frame.texture_coordinates.get(),
+                 h.n_points * sizeof(rs2::texture_coordinate));
+    if (frame.depth) {
+        write_padded(frame.depth.get(), h.n_points * sizeof(uint16_t));
+    }
+    file.flush();
+    if (!file) {
+        throw std::runtime_error("Cannot write the recording");
+    }
+}
+
+void RecordingWriter::write_padded(const void *data, size_t length) {
+    static const char zeros[ALIGNMENT] = {};
+    file.write((const char *)data, length);
+    file.write(zeros, align(length) - length);
+    offset += align(length);
+}
+
+struct Recording::Mapping {
+    uint8_t *data;
+    size_t length;
+
+    ~Mapping() { munmap(data, length); }
+};
+
+std::shared_ptr<const Recording> Recording::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open the recording " + path + ": " +
+                                 strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(FileHeader)) {
+        close(fd);
+        throw std::runtime_error(path + " is not a recording");
+    }
+    const size_t length = st.st_size;
+    // Private and writable, so the frames handed out can be modified in
+    // place like any other frame.
+    void *data =
+        mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Cannot map the recording " + path + ": " +
+                                 strerror(errno));
+    }
+    madvise(data, length, MADV_SEQUENTIAL);
+
+    auto recording = std::make_shared<Recording>();
+    recording->mapping.reset(new Mapping{(uint8_t *)data, length});
+    const uint8_t *base = (const uint8_t *)data;
+
+    const FileHeader *header = (const FileHeader *)base;
+    if (memcmp(header->magic, FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != VERSION) {
+        throw std::runtime_error(path + " is not a recording");
+    }
+
+    // Whether a whole record starts at offset and ends before end.
+    auto valid_record = [&](uint64_t offset, uint64_t end) {
+        if (offset % ALIGNMENT != 0 || offset + sizeof(RecordHeader) > end) {
+            return false;
+        }
+        const RecordHeader *h = (const RecordHeader *)(base + offset);
+        return h->magic == RECORD_MAGIC && h->length == record_length(*h) &&
+               h->length <= end - offset;
+    };
+
+    auto &offsets = recording->offsets;
+    bool indexed = false;
+    if (length >= align(sizeof(FileHeader)) + sizeof(Trailer)) {
+        const Trailer *trailer =
+            (const Trailer *)(base + length - sizeof(Trailer));
+        const uint64_t index_end = length - sizeof(Trailer);
+        if (memcmp(trailer->magic, TRAILER_MAGIC, sizeof(trailer->magic)) ==
+                0 &&
+            trailer->index_offset <= index_end &&
+            index_end - trailer->index_offset ==
+                trailer->frame_count * sizeof(IndexEntry)) {
+            const IndexEntry *entries =
+                (const IndexEntry *)(base + trailer->index_offset);
+            indexed = true;
+            for (uint64_t i = 0; i < trailer->frame_count; i++) {
+                if (!valid_record(entries[i].offset, trailer->index_offset)) {
+                    indexed = false;
+                    break;
+                }
+                offsets.push_back(entries[i].offset);
+            }
+        }
+    }
+    if (!indexed) {
+        offsets.clear();
+        uint64_t offset = align(sizeof(FileHeader));
+        while (valid_record(offset, length)) {
+            offsets.push_back(offset);
+            offset += ((const RecordHeader *)(base + offset))->length;
+        }
+        LOG(WARNING) << path << " has no index. Found " << offsets.size()
+                     << " frames in it.";
+    }
+    return recording;
+}
+
+int64_t Recording::timestamp_us(size_t i) const {
+    return ((const RecordHeader *)(mapping->data + offsets[i]))->timestamp_us;
+}
+
+eye_like::EyesPosition Recording::eyes(size_t i) const {
+    const RecordHeader &h = *(const RecordHeader *)(mapping->data + offsets[i]);
+    return eye_like::EyesPosition{h.eyes[0], h.eyes[1], h.eyes[2], h.eyes[3]};
+}
+
+rs2_frame_data Recording::frame(size_t i) const {
+    uint8_t *p = mapping->data + offsets[i];
+    const RecordHeader &h = *(const RecordHeader *)p;
+    p += align(sizeof(RecordHeader));
+
+    rs2_frame_data frame;
+    frame.width = h.width;
+    frame.height = h.height;
+    frame.n_points = h.n_points;
+    frame.face = cv::Rect(h.face_x, h.face_y, h.face_width, h.face_height);
+
+    // A reference count of this frame alone, which keeps the mapping alive.
+    auto owner = std::make_shared<std::shared_ptr<const Mapping>>(mapping);
+    frame.rgb = std::shared_ptr<uint8_t>(owner, p);
+    p += align(rgb_length(h));
+    frame.vertices = std::shared_ptr<rs2::vertex>(owner, (rs2::vertex *)p);
+    p += align(h.n_points * sizeof(rs2::vertex));
+    frame.texture_coordinates = std::shared_ptr<rs2::texture_coordinate>(
+        owner, (rs2::texture_coordinate *)p);
+    p += align(h.n_points * sizeof(rs2::texture_coordinate));
+    if (h.flags & HAS_DEPTH) {
+        frame.depth = std::shared_ptr<uint16_t>(owner, (uint16_t *)p);
+        frame.depth_scale = h.depth_scale;
+        frame.depth_intrinsics = h.depth_intrinsics;
+        frame.color_intrinsics = h.color_intrinsics;
+        frame.depth_to_color = h.depth_to_color;
+    }
+    return frame;
+}
+
+RecordingPlayer::RecordingPlayer(std::shared_ptr<const Recording> recording_,
+                                 bool max_speed_, bool loop_)
+    : recording(std::move(recording_)), max_speed(max_speed_), loop(loop_),
+      start(std::chrono::steady_clock::now()) {}
+
+bool RecordingPlayer::due() {
+    if (position == recording->size() && (!loop || position == 0)) {
+        // next returns false.
+        return true;
+    }
+    if (max_speed) {
+        return !in_use();
+    }
+    if (position == recording->size()) {
+        // The next pass starts right away.
+        return true;
+    }
+    return std::chrono::steady_clock::now() >=
+           start + std::chrono::microseconds(recording->timestamp_us(position) -
+                                             recording->timestamp_us(0));
+}
+
+bool RecordingPlayer::next(rs2_frame_data &frame,
+                           eye_like::EyesPosition &eyes) {
+    if (position == recording->size()) {
+        if (!loop || recording->size() == 0) {
+            return false;
+        }
+        position = 0;
+        start = std::chrono::steady_clock::now();
+    }
+    if (max_speed) {
+        while (in_use()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    } else {
+        std::this_thread::sleep_until(
+            start +
+            std::chrono::microseconds(recording->timestamp_us(position) -
+                                      recording->timestamp_us(0)));
+    }
+    frame = recording->frame(position);
+    eyes = recording->eyes(position);
+    position++;
+    if (max_speed) {
+        handed_out.push_back(frame.rgb);
+    }
+    return true;
+}
+
+bool RecordingPlayer::in_use() {
+    // Only the player holds the frames whose count is 1.
+    std::erase_if(handed_out, [](const std::shared_ptr<uint8_t> &buffer) {
+        return buffer.use_count() == 1;
+    });
+    return handed_out.size() >= FRAME_POOL_CAPACITY;
+}
+
+} // namespace camera
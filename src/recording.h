@@ -0,0 +1,103 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "camera.h"
+
+// A recording is one file of camera frames with the time they were captured
+// and the eye positions tracked with them, followed by a seek index:
+//
+//   file header | record | record | ... | index | trailer
+//
+// A record is a RecordHeader followed by the color image, the vertices, the
+// texture coordinates and the optional depth image, each starting on a
+// 16-byte boundary so that they can be used in place from a mapping of the
+// file. When the writer never got to write the index, e.g. because the
+// program was killed, the reader finds the records by walking them instead.
+namespace camera {
+
+class RecordingWriter {
+  public:
+    // Truncates path. Throws std::runtime_error when it cannot be created.
+    explicit RecordingWriter(const std::string &path);
+    // Writes the index.
+    ~RecordingWriter();
+
+    // Appends a frame stamped with the time since the first one. The file is
+    // flushed, so every appended frame survives the process.
+    void append(const rs2_frame_data &frame,
+                const eye_like::EyesPosition &eyes);
+
+  private:
+    struct IndexEntry {
+        uint64_t offset;
+        int64_t timestamp_us;
+    };
+
+    void write_padded(const void *data, size_t length);
+
+    std::ofstream file;
+    uint64_t offset = 0;
+    std::chrono::steady_clock::time_point start;
+    std::vector<IndexEntry> index;
+};
+
+// A read-only view of a recording. The file is mapped rather than read, and
+// the frames point into the mapping, so handing out a frame copies nothing.
+// The mapping lives as long as any frame refers to it.
+class Recording {
+  public:
+    // Throws std::runtime_error when path is not a recording.
+    static std::shared_ptr<const Recording> open(const std::string &path);
+
+    size_t size() const { return offsets.size(); }
+    // Microseconds since the first frame.
+    int64_t timestamp_us(size_t i) const;
+    eye_like::EyesPosition eyes(size_t i) const;
+    // The buffers of the frame share one reference count of their own, so a
+    // caller can tell when every user of the frame has released it. The
+    // mapping is private, so writing to the buffers does not change the file.
+    rs2_frame_data frame(size_t i) const;
+
+    struct Mapping;
+
+  private:
+    std::shared_ptr<const Mapping> mapping;
+    std::vector<uint64_t> offsets;
+};
+
+// Hands out the frames of a recording in order, either at the rate they were
+// recorded or as fast as they are released.
+class RecordingPlayer {
+  public:
+    RecordingPlayer(std::shared_ptr<const Recording> recording,
+                    bool max_speed, bool loop);
+
+    // Whether next would return without waiting.
+    bool due();
+
+    // Waits until the next frame is due: at its recorded time, or at max
+    // speed until fewer than FRAME_POOL_CAPACITY frames are in use. Returns
+    // false after the last frame when not looping.
+    bool next(rs2_frame_data &frame, eye_like::EyesPosition &eyes);
+
+  private:
+    bool in_use();
+
+    std::shared_ptr<const Recording> recording;
+    bool max_speed;
+    bool loop;
+    size_t position = 0;
+    // When frame 0 of the current pass is due.
+    std::chrono::steady_clock::time_point start;
+    // A buffer of each frame handed out at max speed which may still be in
+    // use.
+    std::vector<std::shared_ptr<uint8_t>> handed_out;
+};
+
+} // namespace camera
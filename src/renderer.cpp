@@ -1,4 +1,5 @@
 #include "renderer.h"
+#include "recording.h"
 
 #include <librealsense2/rs.hpp> // Include RealSense Cross Platform API
 #include <opencv2/highgui/highgui.hpp>
@@ -6,6 +7,7 @@
 #include <opencv2/objdetect/objdetect.hpp>
 
 #include <algorithm>
+#include <map>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -41,6 +43,21 @@ void upload_texture(uint8_t *color_data, int width, int height, GLuint &id) {
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+// The latest frame of one source.
+struct Cloud {
+    int n_points = 0;
+    std::shared_ptr<rs2::vertex> vertices;
+    std::shared_ptr<rs2::texture_coordinate> texture_coordinates;
+    GLuint gl_texture_id = 0;
+};
+
+void show(const camera::rs2_frame_data &f, Cloud &cloud) {
+    cloud.n_points = f.n_points;
+    cloud.vertices = f.vertices;
+    cloud.texture_coordinates = f.texture_coordinates;
+    upload_texture(f.rgb.get(), f.width, f.height, cloud.gl_texture_id);
+}
+
 // Handles all the OpenGL calls needed to display the point cloud
 void draw_pointcloud_render(float width, float height,
                             eye_like::EyesPosition eye_position, int n_point,
@@ -156,11 +173,22 @@ int renderer_main_loop(
     eye_like::EyesPosition eye_position =
         eye_like::EyesPosition{0.0, 0.0, 0.0, 0.0};
 
-    GLuint gl_texture_id = 0;
-
-    int n_points;
-    std::shared_ptr<rs2::vertex> vertices;
-    std::shared_ptr<rs2::texture_coordinate> texture_coordinates;
+    // By the peer they come from. Side by side, in the order of the peers.
+    std::map<uint32_t, Cloud> clouds;
+    std::map<uint32_t, std::shared_ptr<camera::rs2_frame_data>> latest;
+
+    // In debug mode, the frames come from the recording of the camera and
+    // the eye positions recorded with them.
+    std::unique_ptr<camera::RecordingPlayer> player;
+    if (debug) {
+        try {
+            player = std::make_unique<camera::RecordingPlayer>(
+                camera::Recording::open(camera::realsense_recording_file),
+                false, true);
+        } catch (const std::runtime_error &e) {
+            LOG(WARNING) << e.what();
+        }
+    }
 
     LOG(INFO) << "Start the main loop of renderer";
     int render_count = 0;
@@ -169,34 +197,44 @@ int renderer_main_loop(
            glfwWindowShouldClose(window) == 0) {
         start = std::chrono::system_clock::now();
         if (!frame_queue.empty()) {
-            auto f = frame_queue.pop();
-
-            int height = f->height;
-            int width = f->width;
-            n_points = f->n_points;
-            vertices = f->vertices;
-            texture_coordinates = f->texture_coordinates;
-
-            upload_texture(f->rgb.get(), width, height, gl_texture_id);
-        } else if (debug) {
-            auto f = camera::read_frame(camera::realsense_frame_dump_file);
-
-            int height = f.height;
-            int width = f.width;
-            n_points = f.n_points;
-            vertices = f.vertices;
-            texture_coordinates = f.texture_coordinates;
-
-            upload_texture(f.rgb.get(), width, height, gl_texture_id);
+            // Several peers push frames, so only the newest of each is
+            // drawn.
+            while (!frame_queue.empty()) {
+                auto f = frame_queue.pop();
+                latest[f->source] = f;
+            }
+            for (auto &[source, f] : latest) {
+                show(*f, clouds[source]);
+            }
+            latest.clear();
+        } else if (player && player->due()) {
+            camera::rs2_frame_data f;
+            if (player->next(f, eye_position)) {
+                show(f, clouds[0]);
+            }
         }
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        if (vertices && texture_coordinates) {
-            eye_position = eye_pos_get.get();
-            draw_pointcloud_render(window_width, window_height, eye_position,
-                                   n_points, vertices.get(),
-                                   texture_coordinates.get(), gl_texture_id);
+        if (!clouds.empty()) {
+            if (!player) {
+                eye_position = eye_pos_get.get();
+            }
+            int framebuffer_width, framebuffer_height;
+            glfwGetFramebufferSize(window, &framebuffer_width,
+                                   &framebuffer_height);
+            const int n_clouds = clouds.size();
+            int i = 0;
+            for (const auto &[source, cloud] : clouds) {
+                glViewport(framebuffer_width * i / n_clouds, 0,
+                           framebuffer_width / n_clouds, framebuffer_height);
+                draw_pointcloud_render(
+                    (float)window_width / n_clouds, window_height,
+                    eye_position, cloud.n_points, cloud.vertices.get(),
+                    cloud.texture_coordinates.get(), cloud.gl_texture_id);
+                i++;
+            }
+            glViewport(0, 0, framebuffer_width, framebuffer_height);
         }
 
         glfwSwapBuffers(window);
@@ -0,0 +1,72 @@
+#include "ring_buffer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <glog/logging.h>
+
+namespace connector {
+
+namespace {
+
+// A file of length bytes which lives in memory only.
+int create_memory_file(size_t length) {
+#ifdef __linux__
+    int fd = memfd_create("minago-ring", MFD_CLOEXEC);
+#else
+    static std::atomic<int> counter(0);
+    const std::string name = "/minago-ring-" + std::to_string(getpid()) +
+                             "-" + std::to_string(counter++);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name.c_str());
+    }
+#endif
+    if (fd < 0) {
+        LOG(FATAL) << "Cannot create the ring buffer: " << strerror(errno);
+    }
+    if (ftruncate(fd, length) < 0) {
+        LOG(FATAL) << "Cannot size the ring buffer: " << strerror(errno);
+    }
+    return fd;
+}
+
+} // namespace
+
+MirroredRingBuffer::MirroredRingBuffer(size_t capacity) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    length = (capacity + page - 1) / page * page;
+    const int fd = create_memory_file(length);
+
+    // Reserve both halves at once, so that they are adjacent, then map the
+    // file over each of them.
+    void *reserved = mmap(nullptr, 2 * length, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) {
+        LOG(FATAL) << "Cannot reserve the ring buffer: " << strerror(errno);
+    }
+    base = (char *)reserved;
+    for (char *half : {base, base + length}) {
+        if (mmap(half, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, 0) == MAP_FAILED) {
+            LOG(FATAL) << "Cannot map the ring buffer: " << strerror(errno);
+        }
+    }
+    // The mappings keep the file.
+    close(fd);
+}
+
+MirroredRingBuffer::~MirroredRingBuffer() { munmap(base, 2 * length); }
+
+void MirroredRingBuffer::consume(size_t n) {
+    head = (head + n) % length;
+    used -= n;
+}
+
+} // namespace connector
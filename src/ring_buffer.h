@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+
+namespace connector {
+
+// A byte ring buffer whose pages are mapped twice in a row, so that up to
+// capacity() bytes from any position are contiguous in memory. Received bytes
+// are written after the readable ones and consumed from the front in place,
+// without ever being moved.
+class MirroredRingBuffer {
+  public:
+    // The capacity is rounded up to whole pages.
+    explicit MirroredRingBuffer(size_t capacity);
+    ~MirroredRingBuffer();
+
+    MirroredRingBuffer(const MirroredRingBuffer &) = delete;
+    MirroredRingBuffer &operator=(const MirroredRingBuffer &) = delete;
+
+    size_t capacity() const { return length; }
+
+    // The readable bytes.
+    const char *data() const { return base + head; }
+    size_t size() const { return used; }
+
+    // Where the next bytes go, and how many fit.
+    char *write_pointer() { return base + (head + used) % length; }
+    size_t free_space() const { return length - used; }
+
+    // Makes n bytes written at write_pointer readable.
+    void commit(size_t n) { used += n; }
+    // Drops the first n readable bytes.
+    void consume(size_t n);
+
+  private:
+    size_t length;
+    char *base;
+    size_t head = 0;
+    size_t used = 0;
+};
+
+} // namespace connector
@@ -0,0 +1,61 @@
+#include "rle.h"
+
+#include <string.h>
+
+namespace rle {
+namespace {
+
+void put_varint(uint64_t v, std::vector<uint8_t> &output) {
+    while (v >= 0x80) {
+        output.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    output.push_back((uint8_t)v);
+}
+
+bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        const uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+} // namespace
+
+void encode_mask(const uint8_t *mask, size_t n, std::vector<uint8_t> &output) {
+    output.clear();
+    bool value = false;
+    size_t i = 0;
+    while (i < n) {
+        size_t run = 0;
+        while (i + run < n && (bool)mask[i + run] == value) {
+            run++;
+        }
+        put_varint(run, output);
+        i += run;
+        value = !value;
+    }
+}
+
+bool decode_mask(const uint8_t *input, size_t input_length, uint8_t *mask,
+                 size_t n) {
+    const uint8_t *p = input;
+    const uint8_t *end = input + input_length;
+    bool value = false;
+    size_t i = 0;
+    while (p < end) {
+        uint64_t run;
+        if (!get_varint(p, end, run) || run > n - i)
+            return false;
+        memset(mask + i, value, run);
+        i += run;
+        value = !value;
+    }
+    return i == n;
+}
+
+} // namespace rle
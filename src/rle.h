@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Run-length coding of a boolean mask. The mask is stored as the lengths of
+// its runs as LEB128 varints, alternating between false and true and starting
+// with false. The first run is empty when the mask starts with true.
+namespace rle {
+
+// Replaces the contents of output, whose capacity is reused.
+void encode_mask(const uint8_t *mask, size_t n, std::vector<uint8_t> &output);
+
+// Returns false when the runs do not add up to exactly n.
+bool decode_mask(const uint8_t *input, size_t input_length, uint8_t *mask,
+                 size_t n);
+
+} // namespace rle
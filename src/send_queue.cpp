@@ -0,0 +1,130 @@
+#include "send_queue.h"
+
+#include <algorithm>
+
+namespace connector {
+
+using frame_format::SerializedFrame;
+
+SendQueue::SendQueue(std::unique_ptr<Sender> sender_, size_t capacity_,
+                     bool may_drop_)
+    : sender(std::move(sender_)), capacity(capacity_), may_drop(may_drop_),
+      thread(&SendQueue::send_main_loop, this) {}
+
+SendQueue::~SendQueue() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stopping = true;
+    }
+    pushed.notify_one();
+    popped.notify_all();
+    thread.join();
+}
+
+bool SendQueue::push(std::shared_ptr<const SerializedFrame> frame,
+                     bool keyframe) {
+    std::unique_lock<std::mutex> lock(m);
+    if (!may_drop) {
+        popped.wait(lock, [&] {
+            return broken || stopping || n_waiting_frames < capacity;
+        });
+    }
+    if (broken) {
+        return true;
+    }
+    if (waiting_for_keyframe) {
+        // The keyframe has been asked for already.
+        if (!keyframe) {
+            return true;
+        }
+        waiting_for_keyframe = false;
+    }
+    bool dropped = false;
+    if (n_waiting_frames >= capacity) {
+        waiting.erase(std::remove_if(waiting.begin(), waiting.end(),
+                                     [&](const Entry &entry) {
+                                         if (!entry.control) {
+                                             waiting_bytes -=
+                                                 entry.frame->length();
+                                         }
+                                         return !entry.control;
+                                     }),
+                      waiting.end());
+        n_waiting_frames = 0;
+        dropped = true;
+    }
+    if (dropped && !keyframe) {
+        waiting_for_keyframe = true;
+        return false;
+    }
+    // A keyframe needs nothing before it.
+    waiting.push_back({frame, false});
+    n_waiting_frames++;
+    waiting_bytes += frame->length();
+    pushed.notify_one();
+    return true;
+}
+
+void SendQueue::push_control(std::shared_ptr<const SerializedFrame> frame) {
+    std::lock_guard<std::mutex> lock(m);
+    if (broken) {
+        return;
+    }
+    waiting.push_back({frame, true});
+    waiting_bytes += frame->length();
+    pushed.notify_one();
+}
+
+bool SendQueue::connected() const {
+    std::lock_guard<std::mutex> lock(m);
+    return !broken;
+}
+
+SendQueue::SocketState SendQueue::socket_state() const {
+    std::lock_guard<std::mutex> lock(m);
+    // The socket queue may hold part of the frame being sent already, which
+    // sent_bytes does not count yet.
+    const size_t queued =
+        sending_bytes > 0 ? queued_before_send : sender->queued_bytes();
+    const size_t unsent = sending_bytes + waiting_bytes;
+    return {sent_bytes + unsent, queued + unsent};
+}
+
+void SendQueue::send_main_loop() {
+    std::unique_lock<std::mutex> lock(m);
+    while (true) {
+        pushed.wait(lock, [&] { return stopping || !waiting.empty(); });
+        if (stopping) {
+            return;
+        }
+        Entry entry = std::move(waiting.front());
+        waiting.pop_front();
+        if (!entry.control) {
+            n_waiting_frames--;
+            popped.notify_all();
+        }
+        // The frame moves from waiting to being sent.
+        waiting_bytes -= entry.frame->length();
+        sending_bytes = entry.frame->length();
+        queued_before_send = sender->queued_bytes();
+        lock.unlock();
+        const bool sent = sender->send(entry.frame);
+        // With zerocopy, releases the frames the kernel is done with.
+        sender->reap_completions();
+        const uint64_t written = sender->bytes_written();
+        lock.lock();
+        // Counted as sent from here on.
+        sending_bytes = 0;
+        sent_bytes = written;
+        if (!sent) {
+            broken = true;
+            waiting.clear();
+            n_waiting_frames = 0;
+            waiting_bytes = 0;
+            popped.notify_all();
+            return;
+        }
+    }
+}
+
+} // namespace connector
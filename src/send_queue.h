@@ -0,0 +1,86 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "frame_format.h"
+#include "frame_sender.h"
+
+namespace connector {
+
+// Sends frames to one peer on a thread of its own, so that a slow peer does
+// not hold up the encoder or the other peers. The frames are shared with the
+// queues of the other peers, so each is serialized once however many peers
+// get it.
+//
+// At most capacity frames wait. A frame which finds the queue full drops the
+// waiting ones, and as the frames up to the next keyframe refer to them, the
+// queue drops those too. Without may_drop, it waits for room instead, for
+// codec streams, which restart at a keyframe but lose their history then.
+class SendQueue {
+  public:
+    SendQueue(std::unique_ptr<Sender> sender, size_t capacity, bool may_drop);
+    // Drops the waiting frames. Shut the socket down first when the thread
+    // may be blocked in a send.
+    ~SendQueue();
+
+    SendQueue(const SendQueue &) = delete;
+    SendQueue &operator=(const SendQueue &) = delete;
+
+    // Returns false when it dropped frames. Send a keyframe next then. Blocks
+    // while the queue is full without may_drop.
+    bool push(std::shared_ptr<const frame_format::SerializedFrame> frame,
+              bool keyframe);
+
+    // For frames which no other frame refers to, such as keyframe requests.
+    // They are never dropped.
+    void
+    push_control(std::shared_ptr<const frame_format::SerializedFrame> frame);
+
+    // False once a send failed. Everything pushed is dropped then.
+    bool connected() const;
+
+    // As bytes_written and queued_bytes of Sender, counting the waiting
+    // frames as written and queued. Both are sampled together, and while a
+    // frame is being sent, the socket queue is the one from before it, so the
+    // frame is counted once. Callable from any thread.
+    struct SocketState {
+        uint64_t bytes_written;
+        size_t queued_bytes;
+    };
+    SocketState socket_state() const;
+
+  private:
+    struct Entry {
+        std::shared_ptr<const frame_format::SerializedFrame> frame;
+        bool control;
+    };
+
+    void send_main_loop();
+
+    std::unique_ptr<Sender> sender;
+    const size_t capacity;
+    const bool may_drop;
+    mutable std::mutex m;
+    std::condition_variable pushed;
+    std::condition_variable popped;
+    std::deque<Entry> waiting;
+    size_t n_waiting_frames = 0;
+    size_t waiting_bytes = 0;
+    // What the sender has written so far.
+    uint64_t sent_bytes = 0;
+    // The length of the frame being sent, or 0, and the bytes in the socket
+    // queue when its send started.
+    size_t sending_bytes = 0;
+    size_t queued_before_send = 0;
+    bool waiting_for_keyframe = false;
+    bool broken = false;
+    bool stopping = false;
+    std::thread thread;
+};
+
+} // namespace connector
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -40,6 +47,11 @@ template <class T> class ThreadSafeQueue {
         bool empty() const { return que->empty(); }
         void pop(T &res) { que->pop(res); }
         std::shared_ptr<T> pop() { return std::move(que->pop()); }
+        // A descriptor which polls readable after a push, for waiting on the
+        // queue together with sockets. Clear it before emptying the queue,
+        // so that a value pushed meanwhile makes it readable again.
+        int notification_fd() { return que->notification_fd(); }
+        void clear_notification() { que->clear_notification(); }
         explicit ThreadSafeQueuePopViewer(ThreadSafeQueue<T> *que_)
             : que(que_) {}
         ~ThreadSafeQueuePopViewer() { que->have_pop_viewer = false; }
@@ -64,11 +76,70 @@ template <class T> class ThreadSafeQueue {
         return ThreadSafeQueuePushViewer(this);
     }
 
+    ~ThreadSafeQueue() {
+        if (notify_fds[0] >= 0) {
+            close(notify_fds[0]);
+        }
+        if (notify_fds[1] != notify_fds[0]) {
+            close(notify_fds[1]);
+        }
+    }
+
   private:
     std::queue<T> que;
     mutable std::mutex m;
     bool have_push_viewer = false;
     bool have_pop_viewer = false;
+    // Created by the first notification_fd call, so that pushes to queues
+    // nobody waits on with poll cost no system call. [0] is polled and [1]
+    // is written. Both are the same eventfd on Linux and the ends of a pipe
+    // elsewhere.
+    int notify_fds[2] = {-1, -1};
+
+    int notification_fd() {
+        std::lock_guard<std::mutex> lock(m);
+        if (notify_fds[0] < 0) {
+#ifdef __linux__
+            notify_fds[0] = notify_fds[1] =
+                eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+            if (pipe(notify_fds) == 0) {
+                fcntl(notify_fds[0], F_SETFL, O_NONBLOCK);
+                fcntl(notify_fds[1], F_SETFL, O_NONBLOCK);
+            }
+#endif
+            if (!que.empty()) {
+                notify();
+            }
+        }
+        return notify_fds[0];
+    }
+
+    void clear_notification() {
+#ifdef __linux__
+        uint64_t count;
+        (void)!read(notify_fds[0], &count, sizeof(count));
+#else
+        char buf[64];
+        while (read(notify_fds[0], buf, sizeof(buf)) > 0) {
+        }
+#endif
+    }
+
+    // Called with m held.
+    void notify() {
+        if (notify_fds[1] < 0) {
+            return;
+        }
+#ifdef __linux__
+        const uint64_t one = 1;
+        (void)!write(notify_fds[1], &one, sizeof(one));
+#else
+        // When the pipe is full, it is readable already.
+        const char one = 1;
+        (void)!write(notify_fds[1], &one, 1);
+#endif
+    }
 
     void pop(T &res) {
         std::lock_guard<std::mutex> lock(m);
@@ -90,6 +161,7 @@ template <class T> class ThreadSafeQueue {
     void push(T value) {
         std::lock_guard<std::mutex> lock(m);
         que.push(value);
+        notify();
     }
 
     bool empty() const {
@@ -0,0 +1,175 @@
+#include "video_codec.h"
+
+#include <glog/logging.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#ifdef HAVE_VPX
+#include <vpx/vp8cx.h>
+#include <vpx/vp8dx.h>
+#include <vpx/vpx_decoder.h>
+#include <vpx/vpx_encoder.h>
+#endif
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace video_codec {
+
+#ifdef HAVE_VPX
+
+bool available() { return true; }
+
+struct Encoder::Context {
+    vpx_codec_ctx_t codec;
+    vpx_codec_enc_cfg_t cfg;
+    // The input converted to I420.
+    cv::Mat i420;
+};
+
+Encoder::Encoder(int width, int height, int fps)
+    : context(new Context), width_(width), height_(height) {
+    vpx_codec_enc_cfg_t &cfg = context->cfg;
+    if (vpx_codec_enc_config_default(vpx_codec_vp8_cx(), &cfg, 0) !=
+        VPX_CODEC_OK) {
+        throw std::runtime_error("vpx_codec_enc_config_default failed");
+    }
+    cfg.g_w = width;
+    cfg.g_h = height;
+    cfg.g_timebase.num = 1;
+    cfg.g_timebase.den = fps;
+    cfg.g_lag_in_frames = 0;
+    cfg.g_threads = 2;
+    cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+    // The connector decides when to send keyframes.
+    cfg.kf_mode = VPX_KF_DISABLED;
+    // Constant quality. The rate controller picks the quality.
+    cfg.rc_end_usage = VPX_Q;
+    cfg.rc_min_quantizer = 0;
+    cfg.rc_max_quantizer = 63;
+    if (vpx_codec_enc_init(&context->codec, vpx_codec_vp8_cx(), &cfg, 0) !=
+        VPX_CODEC_OK) {
+        throw std::runtime_error("vpx_codec_enc_init failed");
+    }
+    // The fastest realtime preset.
+    vpx_codec_control(&context->codec, VP8E_SET_CPUUSED, 16);
+    vpx_codec_control(&context->codec, VP8E_SET_STATIC_THRESHOLD, 1);
+}
+
+Encoder::~Encoder() { vpx_codec_destroy(&context->codec); }
+
+bool Encoder::encode(const uint8_t *bgr, int quality_, bool keyframe,
+                     std::vector<uint8_t> &output) {
+    if (quality_ != quality) {
+        quality = quality_;
+        // 100 is the finest quantizer and 1 the coarsest.
+        const int cq_level = (100 - std::clamp(quality, 1, 100)) * 63 / 99;
+        vpx_codec_control(&context->codec, VP8E_SET_CQ_LEVEL, cq_level);
+    }
+
+    const cv::Mat image(height_, width_, CV_8UC3, (void *)bgr);
+    cv::cvtColor(image, context->i420, cv::COLOR_BGR2YUV_I420);
+    vpx_image_t img;
+    vpx_img_wrap(&img, VPX_IMG_FMT_I420, width_, height_, 1,
+                 context->i420.data);
+
+    const vpx_enc_frame_flags_t flags = keyframe ? VPX_EFLAG_FORCE_KF : 0;
+    if (vpx_codec_encode(&context->codec, &img, pts++, 1, flags,
+                         VPX_DL_REALTIME) != VPX_CODEC_OK) {
+        LOG(ERROR) << "vpx_codec_encode failed: "
+                   << vpx_codec_error(&context->codec);
+        return false;
+    }
+
+    output.clear();
+    vpx_codec_iter_t iter = nullptr;
+    const vpx_codec_cx_pkt_t *pkt;
+    while ((pkt = vpx_codec_get_cx_data(&context->codec, &iter))) {
+        if (pkt->kind == VPX_CODEC_CX_FRAME_PKT) {
+            const uint8_t *data = (const uint8_t *)pkt->data.frame.buf;
+            output.insert(output.end(), data, data + pkt->data.frame.sz);
+        }
+    }
+    return true;
+}
+
+struct Decoder::Context {
+    vpx_codec_ctx_t codec;
+    // The decoded image packed into I420.
+    cv::Mat i420;
+};
+
+Decoder::Decoder() : context(new Context) {
+    if (vpx_codec_dec_init(&context->codec, vpx_codec_vp8_dx(), nullptr, 0) !=
+        VPX_CODEC_OK) {
+        throw std::runtime_error("vpx_codec_dec_init failed");
+    }
+}
+
+Decoder::~Decoder() { vpx_codec_destroy(&context->codec); }
+
+bool Decoder::decode(const uint8_t *data, size_t length, uint8_t *bgr,
+                     int width, int height) {
+    if (vpx_codec_decode(&context->codec, data, length, nullptr, 0) !=
+        VPX_CODEC_OK) {
+        LOG(ERROR) << "vpx_codec_decode failed: "
+                   << vpx_codec_error(&context->codec);
+        return false;
+    }
+    vpx_codec_iter_t iter = nullptr;
+    const vpx_image_t *img = vpx_codec_get_frame(&context->codec, &iter);
+    if (!img || (int)img->d_w != width || (int)img->d_h != height ||
+        img->fmt != VPX_IMG_FMT_I420) {
+        return false;
+    }
+
+    // Pack the planes, which have strides, for cvtColor.
+    context->i420.create(height * 3 / 2, width, CV_8UC1);
+    uint8_t *p = context->i420.data;
+    for (int plane = 0; plane < 3; plane++) {
+        const int w = plane == 0 ? width : (width + 1) / 2;
+        const int h = plane == 0 ? height : (height + 1) / 2;
+        for (int y = 0; y < h; y++) {
+            memcpy(p, img->planes[plane] + y * img->stride[plane], w);
+            p += w;
+        }
+    }
+    cv::Mat image(height, width, CV_8UC3, bgr);
+    cv::cvtColor(context->i420, image, cv::COLOR_YUV2BGR_I420);
+    return true;
+}
+
+#else
+
+bool available() { return false; }
+
+struct Encoder::Context {};
+
+Encoder::Encoder(int width, int height, int)
+    : width_(width), height_(height) {
+    throw std::runtime_error("libvpx is not compiled into this binary");
+}
+
+Encoder::~Encoder() {}
+
+bool Encoder::encode(const uint8_t *, int, bool, std::vector<uint8_t> &) {
+    return false;
+}
+
+struct Decoder::Context {};
+
+Decoder::Decoder() {
+    throw std::runtime_error("libvpx is not compiled into this binary");
+}
+
+Decoder::~Decoder() {}
+
+bool Decoder::decode(const uint8_t *, size_t, uint8_t *, int, int) {
+    return false;
+}
+
+#endif
+
+} // namespace video_codec
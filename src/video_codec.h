@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// VP8 coding of a sequence of BGR color images with libvpx, tuned for low
+// latency: no lagged frames, the realtime deadline and keyframes only when
+// asked for. Every encoded frame must be decoded in order, so an encoder
+// belongs to one connection and a decoder to the other end of it.
+namespace video_codec {
+
+// Whether libvpx is compiled into this binary. Without it, the constructors
+// throw std::runtime_error.
+bool available();
+
+class Encoder {
+  public:
+    Encoder(int width, int height, int fps);
+    ~Encoder();
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // quality is from 1 to 100 like JPEG. Returns false on failure.
+    bool encode(const uint8_t *bgr, int quality, bool keyframe,
+                std::vector<uint8_t> &output);
+
+  private:
+    struct Context;
+    std::unique_ptr<Context> context;
+    int width_, height_;
+    int quality = -1;
+    int64_t pts = 0;
+};
+
+class Decoder {
+  public:
+    Decoder();
+    ~Decoder();
+
+    // bgr must hold width * height pixels. Returns false when the frame cannot
+    // be decoded, e.g. because it refers to a frame the decoder has not seen.
+    bool decode(const uint8_t *data, size_t length, uint8_t *bgr, int width,
+                int height);
+
+  private:
+    struct Context;
+    std::unique_ptr<Context> context;
+};
+
+} // namespace video_codec
@@ -0,0 +1,49 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(int n_threads) {
+    for (int i = 0; i < n_threads; i++) {
+        workers.emplace_back(&WorkerPool::worker_main, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+std::future<void> WorkerPool::submit(std::function<void()> task) {
+    std::packaged_task<void()> t(std::move(task));
+    std::future<void> f = t.get_future();
+    if (workers.empty()) {
+        t();
+        return f;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m);
+        tasks.push(std::move(t));
+    }
+    cv.notify_one();
+    return f;
+}
+
+void WorkerPool::worker_main() {
+    while (1) {
+        std::packaged_task<void()> t;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            t = std::move(tasks.front());
+            tasks.pop();
+        }
+        t();
+    }
+}
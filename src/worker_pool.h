@@ -0,0 +1,33 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads which run submitted tasks in FIFO order.
+class WorkerPool {
+  public:
+    // With n_threads == 0, submit runs the task on the calling thread.
+    explicit WorkerPool(int n_threads);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // The future becomes ready when the task finishes and rethrows what the
+    // task threw.
+    std::future<void> submit(std::function<void()> task);
+
+  private:
+    void worker_main();
+
+    std::vector<std::thread> workers;
+    std::queue<std::packaged_task<void()>> tasks;
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopping = false;
+};